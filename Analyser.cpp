@@ -0,0 +1,398 @@
+#include "Analyser.h"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <numeric>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+
+#include "Comparator.h"
+#include "FilesManipulator.h"
+#include "Tracer.h"
+
+using FM = FilesManipulator;
+
+//Parses a samtools-like "contig:from-to" region (1-based, inclusive) into a 0-based half-open interval
+bool Analyser::parseRegion(const string& region, string& contig, size_t& from, size_t& to) {
+	const size_t colon = region.rfind(':');
+	if (colon == string::npos) return false;
+	const size_t dash = region.find('-', colon);
+	if (dash == string::npos) return false;
+
+	try {
+		contig = region.substr(0, colon);
+		from = stoul(region.substr(colon + 1, dash - colon - 1));
+		to = stoul(region.substr(dash + 1));
+	} catch (const exception&) {
+		return false;
+	}
+	if (from == 0 || to < from) return false;
+
+	from--;
+	return true;
+}
+
+//Finds the mutations within [from, to) of the fetched alignments, noting the reads evidence at the VCF positions
+Mutations Analyser::analyseWindow(
+	const RefGenFile& refGen,
+	const string& refGenName,
+	const size_t& refGenLen,
+	const size_t& from,
+	const size_t& to,
+	const MutationsVCF& csvMap,
+	Alignments& startingPos,
+	Insertions& insertions,
+	Reads& curReads,
+	const size_t& minReads
+) {
+	Mutations errors;
+	const string windowRefGen = FM::getRefGenSlice(refGen, refGenName, from, min(to, refGenLen));
+	curReads.setRefGenLine(windowRefGen);
+	// Own block, so that the span covers the position loop alone
+	{
+		TRACE_SPAN("positions", refGenName.c_str(), from);
+		for (size_t linePos = 0; linePos < windowRefGen.size(); linePos++) {
+			size_t curPos = linePos + from;
+
+			// Add new reads that start at the current position to the list of the ones analysed
+			if (startingPos.find(curPos) != startingPos.end()) curReads.addReads(startingPos, curPos);
+
+			//TODO if the size of curReads is less than 5, move curPos to the next element available in startingPos or among insertion indices
+			//TODO instead of constantly iterating over reads, have a map that will store pointers to the respective curReads and name of the read
+
+			// If the number of reads for the current position is less than 5, we do not have enough data to do a meaningful evaluation
+			bool isMutation = false;
+			if (csvMap.find(curPos) != csvMap.end()) {
+				for (const auto& aux: csvMap.at(curPos)) {
+					if (std::get<1>(aux) != 'I') {
+						isMutation = true;
+						break;
+					}
+				}
+			}
+
+			auto curErrors = curReads.iteration(curPos, linePos, minReads, isMutation);
+			if (!curErrors.empty()) errors.merge(curErrors);
+		}
+	}
+
+	const auto insErrors = insertions.findInsertionMutations(csvMap, minReads);
+	for (const auto& [key, vec] : insErrors) {
+		errors[key].insert(errors[key].end(), vec.begin(), vec.end());
+	}
+
+	return errors;
+}
+
+//Runs the sliding windows over [from, to) of a single contig and compares the findings with the VCF calls, filling
+//the results of the contig. If the ground truth is given, the agreement of the calls, the VCF and the ground truth is
+//collected as well. If the checkpoint prefix is set, the state is saved every checkpointEvery windows and once the
+//contig is finished
+void Analyser::processContig(
+	const AnalysisJob& job,
+	const size_t& windowSize,
+	MutationsVCF& csvMap,
+	const MutationsVCF* groundTruth,
+	ContigResult& contig
+) {
+	// The results of the windows since the last save are kept in the checkpoint state, so that saving it does not need
+	// to copy them and only appends them to the ones saved before
+	Checkpoint state;
+	// Every contig (and shard) has its own checkpoint, so that the threads never write the same file
+	const string checkpointFile = job.checkpoint.empty() ? "" : job.checkpoint + "." + contig.name + "." +
+		std::to_string(contig.from) + "-" + std::to_string(contig.to);
+	const auto alignmentFile = FM::openAlignmentFile(job.alignment);
+	const RefGenFile refGen = FM::openRefGen(job.refGen);
+	Reads curReads(job.maxDepth, job.seed);
+	Insertions insertions;
+	std::map<size_t, NucleoCounter> nonErrors;
+	size_t windowStartInd;
+
+	// Everything the results depend on, a checkpoint of any other run (or of inputs changed since) is rejected
+	const string runKey = FM::cacheKey(job.alignment) + "\n" + FM::cacheKey(job.refGen) + "\n" +
+		FM::cacheKey(job.vcf) + "\n" + (groundTruth ? FM::cacheKey(job.groundTruth) : "") + "\n" + contig.name + "\n" +
+		std::to_string(contig.length) + " " + std::to_string(contig.from) + " " + std::to_string(contig.to) + " " +
+		std::to_string(windowSize) + " " + std::to_string(job.minReads) + " " + std::to_string(job.maxDepth) + " " +
+		std::to_string(job.seed) + " " + std::to_string(job.isCollectingCalls);
+
+	auto takeResults = [&] {
+		contig.res.merge(std::move(state.res));
+		state.res = CompRes();
+		for (auto& [key, vec] : state.calls) {
+			contig.calls[key].insert(contig.calls[key].end(), make_move_iterator(vec.begin()),
+			                         make_move_iterator(vec.end()));
+		}
+		state.calls.clear();
+		contig.cappedDepths.merge(state.cappedDepths);
+		state.cappedDepths.clear();
+		contig.agreements.insert(contig.agreements.end(), state.agreements.begin(), state.agreements.end());
+		state.agreements.clear();
+	};
+
+	if (job.isResumed && !checkpointFile.empty() && FM::loadCheckpoint(checkpointFile, runKey, state)) {
+		takeResults();
+		windowStartInd = state.windowStartInd;
+		curReads.restoreState(state);
+		insertions = Insertions(InsertionMap(), std::move(state.nextWindowInsertions));
+		nonErrors = std::move(state.nonErrors);
+	} else {
+		// Reads crossing the start of the shard carry state (cigarIndices, next window insertions) from the earlier
+		// windows, so the windows are replayed from the one in which the earliest of these reads starts, without
+		// reporting anything
+		windowStartInd = contig.from;
+		if (contig.from != 0) {
+			windowStartInd = FM::getFirstOverlappingStart(*alignmentFile, contig.name, contig.from);
+			windowStartInd -= windowStartInd % windowSize;
+		}
+	}
+
+	auto saveState = [&](const size_t& nextWindowStartInd) {
+		state.windowStartInd = nextWindowStartInd;
+		state.nextWindowInsertions = insertions.getNextWindowInsertions();
+		state.nonErrors = nonErrors;
+		curReads.saveState(state);
+		FM::saveCheckpoint(checkpointFile, runKey, state);
+		takeResults();
+	};
+
+	// Iterating through all the available sliding windows in order to cover the whole contig without memory exhaustion
+	for (size_t nWindows = 1; !state.isFinished && windowStartInd < contig.to; windowStartInd += windowSize) {
+		TRACE_SPAN("window", contig.name.c_str(), windowStartInd);
+
+		// Get reads within the sliding window
+		AlignmentMaps alignments = FM::getAlignments(*alignmentFile, windowStartInd, windowStartInd + windowSize,
+		                                             contig.name, insertions.takeNextWindowInsertions(),
+		                                             state.cigarIndices);
+		insertions = std::move(alignments.windowInsertions);
+		curReads.flushNonErrors();
+		insertions.flushNonErrors();
+
+		Mutations errors = analyseWindow(refGen, contig.name, contig.length, windowStartInd,
+		                                 windowStartInd + windowSize, csvMap, alignments.startingPos, insertions, curReads,
+		                                 job.minReads);
+		auto windowCappedDepths = curReads.takeCappedDepths();
+		if (windowStartInd < contig.from) continue;
+
+		state.cappedDepths.merge(windowCappedDepths);
+
+		// Has to be done before the comparison, since it removes the matched mutations
+		if (job.isCollectingCalls) {
+			for (const auto& [key, vec] : errors) state.calls[key].insert(state.calls[key].end(), vec.begin(), vec.end());
+		}
+		if (groundTruth) {
+			auto aux = Comparator::compareWithTruth(csvMap, errors, *groundTruth, windowStartInd,
+			                                        windowStartInd + windowSize);
+			state.agreements.insert(state.agreements.end(), aux.begin(), aux.end());
+		}
+		nonErrors = insertions.takeNonErrors();
+		nonErrors.merge(curReads.takeNonErrors());
+		state.res.merge(Comparator::compareMaps(csvMap, errors, nonErrors, windowStartInd,
+		                                        windowStartInd + windowSize));
+
+		if (!checkpointFile.empty() && nWindows++ % job.checkpointEvery == 0) saveState(windowStartInd + windowSize);
+	}
+
+	//We may have out of boundary indices that are not within the defined windows
+	Mutations errors;
+	if (!state.isFinished && contig.to == contig.length && !insertions.getNextWindowInsertions().empty()) {
+		errors.merge(Insertions(insertions.takeNextWindowInsertions()).findInsertionMutations(csvMap, job.minReads));
+		if (job.isCollectingCalls) {
+			for (const auto& [key, vec] : errors) state.calls[key].insert(state.calls[key].end(), vec.begin(), vec.end());
+		}
+		if (groundTruth) {
+			auto aux = Comparator::compareWithTruth(csvMap, errors, *groundTruth, windowStartInd,
+			                                        windowStartInd + windowSize);
+			state.agreements.insert(state.agreements.end(), aux.begin(), aux.end());
+		}
+		// The reads evidence of the last window is reused, as the out of boundary insertions come from its reads
+		state.res.merge(Comparator::compareMaps(csvMap, errors, nonErrors, windowStartInd,
+		                                        windowStartInd + windowSize));
+	}
+
+	if (!checkpointFile.empty() && !state.isFinished) {
+		state.isFinished = true;
+		saveState(windowStartInd);
+	}
+
+	takeResults();
+}
+
+//Compares the VCF calls within [from, to) of the contig with the reads evidence around them only, instead of the whole
+//contig. Substitutions are checked at their position alone, indels together with indelFlank positions on both sides
+void Analyser::processTargets(
+	const AnalysisJob& job,
+	MutationsVCF& csvMap,
+	const MutationsVCF* groundTruth,
+	ContigResult& contig
+) {
+	// Opened once for all the targets of the contig rather than for every query
+	const auto alignmentFile = FM::openAlignmentFile(job.alignment);
+	const RefGenFile refGen = FM::openRefGen(job.refGen);
+
+	// Overlapping targets are merged, so that no position is analysed twice
+	vector<pair<size_t, size_t>> targets;
+	for (const auto& [pos, vec] : csvMap) {
+		if (pos < contig.from || pos >= contig.to) continue;
+
+		const bool isIndel = any_of(vec.begin(), vec.end(), [](const auto& aux) { return std::get<1>(aux) != 'X'; });
+		const size_t flank = isIndel ? job.indelFlank : 0;
+		size_t from = pos < flank ? 0 : pos - flank;
+		size_t to = min(pos + flank + 1, contig.length);
+		while (!targets.empty() && from <= targets.back().second) {
+			from = min(from, targets.back().first);
+			to = max(to, targets.back().second);
+			targets.pop_back();
+		}
+		targets.emplace_back(from, to);
+	}
+
+	if (targets.empty()) return;
+
+	// The targets are sorted, so a single pass over the contig reads every alignment once, however many targets it
+	// overlaps, and reads starting before a target are clipped to its start from their CIGAR
+	const auto sweep = FM::sweepAlignments(alignmentFile, contig.name, targets.front().first, targets.back().second);
+	for (const auto& [from, to] : targets) {
+		TRACE_SPAN("target", contig.name.c_str(), from);
+		Reads curReads(job.maxDepth, job.seed);
+
+		auto alignments = FM::getTargetAlignments(*sweep, from, to);
+		Mutations errors = analyseWindow(refGen, contig.name, contig.length, from, to, csvMap,
+		                                 alignments.startingPos, alignments.windowInsertions, curReads, job.minReads);
+
+		if (job.isCollectingCalls) {
+			for (const auto& [key, vec] : errors) {
+				contig.calls[key].insert(contig.calls[key].end(), vec.begin(), vec.end());
+			}
+		}
+		contig.cappedDepths.merge(curReads.takeCappedDepths());
+		if (groundTruth) {
+			auto aux = Comparator::compareWithTruth(csvMap, errors, *groundTruth, from, to);
+			contig.agreements.insert(contig.agreements.end(), aux.begin(), aux.end());
+		}
+		auto nonErrors = alignments.windowInsertions.takeNonErrors();
+		nonErrors.merge(curReads.takeNonErrors());
+		contig.res.merge(Comparator::compareMaps(csvMap, errors, nonErrors, from, to));
+	}
+}
+
+AnalysisResult Analyser::run(const AnalysisJob& job) {
+	// The mappings and the reference are process-wide, so they are released even if setting them up fails,
+	// as a server would carry them over into the next job otherwise
+	AnalysisResult result;
+	try {
+		if (job.isMapped) FM::mapInput(job.alignment);
+		FM::setReference(job.alignment, job.refGen);
+		result = runContigs(job);
+	} catch (...) {
+		FM::releaseReference();
+		FM::unmapInputs();
+		throw;
+	}
+
+	FM::releaseReference();
+	FM::unmapInputs();
+	return result;
+}
+
+AnalysisResult Analyser::runContigs(const AnalysisJob& job) {
+	if (job.maxDepth > NucleoCounter::maxDepth) {
+		cerr << "Maximum depth " << job.maxDepth << " exceeds the supported one of " << NucleoCounter::maxDepth << "\n";
+		throw runtime_error("Maximum depth " + std::to_string(job.maxDepth) + " exceeds the supported one");
+	}
+
+	AnalysisResult result;
+	result.contigs = FM::getRefGenContigs(job.alignment);
+
+	ifstream refGenFile(job.refGen);
+	if (!refGenFile.is_open()) {
+		cerr << "Failed to open file: " << job.refGen << "\n";
+		throw runtime_error("Failed to open file: " + job.refGen);
+	}
+
+	string curRefGenLine;
+	while (getline(refGenFile, curRefGenLine) && (curRefGenLine.empty() || curRefGenLine[0] == '>'));
+	result.windowSize = curRefGenLine.size() * LINES_IN_WINDOW;
+	refGenFile.close();
+
+	// By default every contig is analysed as a whole
+	vector<ContigResult>& jobs = result.contigResults;
+	if (job.region.empty()) {
+		for (const auto& [name, length] : result.contigs) jobs.push_back({name, length, 0, length});
+	} else {
+		// A shard always consists of whole windows of a single contig, so that the windows are the same as in an unsharded run
+		string contig;
+		size_t regionFrom, regionTo;
+		const bool isParsed = parseRegion(job.region, contig, regionFrom, regionTo);
+		const auto contigIter = find_if(result.contigs.begin(), result.contigs.end(), [&](const auto& aux) {
+			return aux.first == contig;
+		});
+		if (!isParsed || contigIter == result.contigs.end()) {
+			cerr << "Invalid region: " << job.region << "\n";
+			throw runtime_error("Invalid region: " + job.region);
+		}
+
+		const size_t refGenLen = contigIter->second;
+		regionFrom -= regionFrom % result.windowSize;
+		regionTo = regionTo >= refGenLen ? refGenLen : regionTo - regionTo % result.windowSize;
+		if (regionFrom >= regionTo) {
+			cerr << "Region " << job.region << " does not contain a whole window of " << result.windowSize << " positions\n";
+			throw runtime_error("Region " + job.region + " does not contain a whole window");
+		}
+		jobs.push_back({contig, refGenLen, regionFrom, regionTo});
+	}
+
+	// The truth set may be shared with the other jobs, and the comparison removes the matched mutations from it
+	const auto truthSet = FM::getTruthSet(job.vcf);
+	std::map<string, MutationsVCF> csvMaps;
+	for (auto& contigJob : jobs) {
+		if (const auto aux = truthSet->mutations.find(contigJob.name); aux != truthSet->mutations.end()) {
+			csvMaps[contigJob.name] = aux->second;
+		} else csvMaps[contigJob.name];
+		if (const auto aux = truthSet->reportedErrors.find(contigJob.name); aux != truthSet->reportedErrors.end()) {
+			contigJob.reportedErrorsVCF = aux->second;
+		}
+	}
+
+	// The ground truth files have no contig column, as the simulated genomes consist of a single contig
+	MutationsVCF groundTruth;
+	if (!job.groundTruth.empty()) groundTruth = FM::readGroundTruth(job.groundTruth);
+	const string groundTruthContig = job.groundTruth.empty() || result.contigs.empty() ? ""
+		                                 : result.contigs.front().first;
+
+	// Contigs are independent of each other, and the largest ones are started first so that a long chromosome
+	// is not left running alone at the end while the plasmids have occupied the other threads
+	vector<size_t> order(jobs.size());
+	iota(order.begin(), order.end(), 0);
+	stable_sort(order.begin(), order.end(), [&](const size_t& a, const size_t& b) {
+		return jobs[a].to - jobs[a].from > jobs[b].to - jobs[b].from;
+	});
+
+	vector<exception_ptr> failures(jobs.size());
+	atomic<size_t> nextJob = 0;
+	auto worker = [&] {
+		for (size_t i; (i = nextJob++) < order.size();) {
+			ContigResult& contigJob = jobs[order[i]];
+			const MutationsVCF* contigGroundTruth = !groundTruthContig.empty() && contigJob.name == groundTruthContig
+				                                        ? &groundTruth
+				                                        : nullptr;
+			try {
+				if (job.isTargeted) processTargets(job, csvMaps.at(contigJob.name), contigGroundTruth, contigJob);
+				else processContig(job, result.windowSize, csvMaps.at(contigJob.name), contigGroundTruth, contigJob);
+			} catch (...) {
+				failures[order[i]] = current_exception();
+			}
+		}
+	};
+
+	vector<thread> pool;
+	for (size_t i = 1; i < min(job.nThreads, jobs.size()); i++) pool.emplace_back(worker);
+	worker();
+	for (auto& aux : pool) aux.join();
+	for (const auto& failure : failures) if (failure) rethrow_exception(failure);
+
+	return result;
+}
@@ -0,0 +1,98 @@
+#ifndef ANALYSER_H
+#define ANALYSER_H
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "Structures.h"
+
+#define LINES_IN_WINDOW int(1e2)
+#define MIN_READS 5
+
+using namespace std;
+
+struct RefGenFile;
+
+struct AnalysisJob {
+	string alignment;
+	string refGen;
+	string vcf;
+	// Simulated mutations ("type,pos,base") of the first contig, compared with both the calls and the VCF if set
+	string groundTruth;
+	// Samtools-like region of a single contig, all the contigs are analysed if it is empty
+	string region;
+	size_t nThreads = 1;
+	size_t minReads = MIN_READS;
+	size_t indelFlank = 10;
+	// At most maxDepth reads are analysed at a position, 0 for no limit
+	size_t maxDepth = 0;
+	uint64_t seed = 0;
+	// Prefix of the checkpoint files of the contigs, written every checkpointEvery windows if set
+	string checkpoint;
+	size_t checkpointEvery = 50;
+	bool isResumed = false;
+	// The calls themselves are only kept if they are written out (as a BCF)
+	bool isCollectingCalls = false;
+	bool isTargeted = false;
+	bool isMapped = false;
+};
+
+struct ContigResult {
+	string name;
+	size_t length;
+	// Analysed interval of the contig
+	size_t from;
+	size_t to;
+	size_t reportedErrorsVCF = 0;
+	CompRes res;
+	// Filled only if the job collects the calls
+	Mutations calls;
+	// Original depth of the positions capped at maxDepth
+	std::map<size_t, size_t> cappedDepths;
+	// Agreement of the calls, the VCF and the ground truth, filled only if the ground truth is given
+	Agreements agreements;
+};
+
+struct AnalysisResult {
+	size_t windowSize = 0;
+	// Every contig of the alignment header along with its length
+	vector<pair<string, size_t>> contigs;
+	vector<ContigResult> contigResults;
+};
+
+class Analyser {
+	static bool parseRegion(const string& region, string& contig, size_t& from, size_t& to);
+	static Mutations analyseWindow(
+		const RefGenFile& refGen,
+		const string& refGenName,
+		const size_t& refGenLen,
+		const size_t& from,
+		const size_t& to,
+		const MutationsVCF& csvMap,
+		Alignments& startingPos,
+		Insertions& insertions,
+		Reads& curReads,
+		const size_t& minReads
+	);
+	static void processContig(
+		const AnalysisJob& job,
+		const size_t& windowSize,
+		MutationsVCF& csvMap,
+		const MutationsVCF* groundTruth,
+		ContigResult& contig
+	);
+	static void processTargets(
+		const AnalysisJob& job,
+		MutationsVCF& csvMap,
+		const MutationsVCF* groundTruth,
+		ContigResult& contig
+	);
+	static AnalysisResult runContigs(const AnalysisJob& job);
+
+public:
+	static AnalysisResult run(const AnalysisJob& job);
+};
+
+#endif //ANALYSER_H
@@ -3,10 +3,11 @@
 CompRes Comparator::compareMaps(
 	MutationsVCF& map1,
 	Mutations& map2,
-	std::map<size_t, NucleoCounter> nonErrors,
+	const std::map<size_t, NucleoCounter>& nonErrors,
 	const size_t& from,
 	const size_t& to
 ) {
+	TRACE_SPAN("compareMaps");
 	MutationErrors diffInVCF;
 	MutationErrors diffInCust;
 	InBothEr errors;
@@ -22,8 +23,9 @@ CompRes Comparator::compareMaps(
 
 			// If there is no index in the current implementation, report it as an error
 			if (it == map2.end()) {
+				const auto counter = nonErrors.find(iter->first);
 				diffInVCF.emplace_back(iter->first, std::get<0>(*vecIter), std::get<1>(*vecIter),
-				                       nonErrors[iter->first]);
+				                       counter != nonErrors.end() ? counter->second : NucleoCounter());
 				++vecIter;
 				continue;
 			}
@@ -89,5 +91,40 @@ CompRes Comparator::compareMaps(
 		}
 	}
 
-	return CompRes(diffInVCF, diffInCust, errors);
+	return CompRes(std::move(diffInVCF), std::move(diffInCust), std::move(errors));
+}
+
+//Joins the calls, the VCF and the ground truth within [from, to) on the index, symbol and action of the mutations.
+//Has to be done before compareMaps, which removes the matched mutations from the VCF and the calls
+Agreements Comparator::compareWithTruth(
+	const MutationsVCF& vcf,
+	const Mutations& calls,
+	const MutationsVCF& groundTruth,
+	const size_t& from,
+	const size_t& to
+) {
+	TRACE_SPAN("compareWithTruth");
+	std::map<std::tuple<size_t, char, char>, uint8_t> sources;
+
+	for (auto iter = calls.lower_bound(from); iter != calls.end() && iter->first < to; ++iter) {
+		for (const auto& aux : iter->second) {
+			sources[{iter->first, std::get<0>(aux), std::get<1>(aux)}] |= Sources::calls;
+		}
+	}
+	for (auto iter = vcf.lower_bound(from); iter != vcf.end() && iter->first < to; ++iter) {
+		for (const auto& aux : iter->second) sources[{iter->first, std::get<0>(aux), std::get<1>(aux)}] |= Sources::vcf;
+	}
+	for (auto iter = groundTruth.lower_bound(from); iter != groundTruth.end() && iter->first < to; ++iter) {
+		for (const auto& aux : iter->second) {
+			sources[{iter->first, std::get<0>(aux), std::get<1>(aux)}] |= Sources::truth;
+		}
+	}
+
+	Agreements agreements;
+	agreements.reserve(sources.size());
+	for (const auto& [key, mask] : sources) {
+		agreements.emplace_back(std::get<0>(key), std::get<1>(key), std::get<2>(key), mask);
+	}
+
+	return agreements;
 }
@@ -12,10 +12,17 @@ public:
 	static CompRes compareMaps(
 		MutationsVCF& map1,
 		Mutations& map2,
-		std::map<size_t, NucleoCounter> nonErrors,
+		const std::map<size_t, NucleoCounter>& nonErrors,
 		const size_t &from,
 		const size_t &to
 	);
+	static Agreements compareWithTruth(
+		const MutationsVCF& vcf,
+		const Mutations& calls,
+		const MutationsVCF& groundTruth,
+		const size_t& from,
+		const size_t& to
+	);
 };
 
 
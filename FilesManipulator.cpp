@@ -2,23 +2,192 @@
 
 #include <iostream>
 
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <list>
 #include <boost/icl/interval_map.hpp>
+#include <htslib/faidx.h>
 #include <htslib/sam.h>
 #include <htslib/vcf.h>
 #include <map>
 #include <set>
 #include <utility>
 #include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "Comparator.h"
 
 using namespace std;
 using FM = FilesManipulator;
 
-std::map<string, tuple<size_t, size_t, size_t>> FM::cigarIndices;
+string FM::refFileName;
+samFile* FM::refHolder = nullptr;
+refs_t* FM::sharedRefs = nullptr;
+std::map<string, pair<char*, size_t>> FM::mappedInputs;
+LruCache<string, const TruthSet> FM::truthSets;
+LruCache<string, const std::map<string, string>> FM::refGens;
+LruCache<string, const hts_idx_t> FM::indices;
+
+void FM::enableCaches(const size_t& capacity) {
+	truthSets.setCapacity(capacity);
+	refGens.setCapacity(capacity);
+	indices.setCapacity(capacity);
+}
+
+string FM::cacheKey(const string& fileName) {
+	//A file changed on disk gets a new key, and its stale entry is evicted eventually
+	error_code error;
+	const auto modified = filesystem::last_write_time(fileName, error);
+	if (error) return fileName;
+
+	return fileName + "@" + std::to_string(modified.time_since_epoch().count());
+}
+
+shared_ptr<const hts_idx_t> FM::loadIndex(samFile* in, const string& fileName) {
+	const auto load = [&] {
+		hts_idx_t* idx = sam_index_load(in, fileName.c_str());
+		if (!idx) {
+			cerr << "Failed to load the index of " << fileName << endl;
+			throw runtime_error("Failed to load the index of " + fileName);
+		}
+
+		return shared_ptr<const hts_idx_t>(idx, [](const hts_idx_t* aux) { hts_idx_destroy(const_cast<hts_idx_t*>(aux)); });
+	};
+
+	//A CRAM index is bound to the file handle it has been loaded with, so it cannot be shared
+	if (in->format.format == cram) return load();
+	return indices.get(cacheKey(fileName), load);
+}
+
+shared_ptr<const TruthSet> FM::getTruthSet(const string& fileName) {
+	return truthSets.get(cacheKey(fileName), [&] {
+		TruthSet truthSet;
+		truthSet.mutations = readFreeBayesVCF(fileName, truthSet.reportedErrors);
+		return make_shared<const TruthSet>(std::move(truthSet));
+	});
+}
+
+std::map<string, string> FM::readRefGenContigs(const string& fileName) {
+	faidx_t* fai = fai_load(fileName.c_str());
+	if (!fai) {
+		cerr << "Failed to load the index of " << fileName << endl;
+		throw runtime_error("Failed to load the index of " + fileName);
+	}
+
+	std::map<string, string> contigs;
+	for (int i = 0; i < faidx_nseq(fai); i++) {
+		const char* name = faidx_iseq(fai, i);
+		hts_pos_t len = 0;
+		char* seq = faidx_fetch_seq64(fai, name, 0, faidx_seq_len64(fai, name) - 1, &len);
+		if (seq && len >= 0) contigs[name] = string(seq, len);
+		free(seq);
+	}
+	fai_destroy(fai);
+
+	return contigs;
+}
+
+//Size of the buffer htslib reads the mapped inputs with, so that a window is read with a few large reads
+#define MAPPED_INPUT_BLOCK_SIZE (4 << 20)
+//Upper bound of a BGZF block, the end of a window is only known as the start of its last block
+#define BGZF_MAX_BLOCK_SIZE (64 << 10)
+
+void FM::mapInput(const string& fileName) {
+	for (const string& aux : {fileName, fileName + ".bai", fileName + ".csi", fileName + ".crai"}) {
+		const int fd = open(aux.c_str(), O_RDONLY);
+		if (fd < 0) continue;
+
+		struct stat st{};
+		void* data = fstat(fd, &st) == 0 && st.st_size > 0
+			             ? mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)
+			             : MAP_FAILED;
+		close(fd);
+		if (data == MAP_FAILED) {
+			cerr << "Failed to map " << aux << ", it is read without hints" << endl;
+			continue;
+		}
+
+		//htslib reads the files with read() rather than through the mapping, so the advice only pulls their pages into
+		//the page cache. The index is loaded by the handle of every contig and is fetched as a whole, the alignments
+		//are fetched window by window (adviseInput) as a hint on the whole file would not follow the window schedule
+		if (aux != fileName) madvise(data, st.st_size, MADV_WILLNEED);
+		mappedInputs[aux] = make_pair(static_cast<char*>(data), st.st_size);
+	}
+}
+
+void FM::unmapInputs() {
+	for (const auto& [name, mapping] : mappedInputs) munmap(mapping.first, mapping.second);
+	mappedInputs.clear();
+}
+
+void FM::adviseInput(const string& fileName, const hts_itr_t* iter) {
+	const auto mapped = mappedInputs.find(fileName);
+	if (mapped == mappedInputs.end() || !iter || iter->n_off == 0) return;
+
+	//The compressed offsets of the BGZF blocks the iterator is going to read
+	uint64_t begin = UINT64_MAX;
+	uint64_t end = 0;
+	for (int i = 0; i < iter->n_off; i++) {
+		begin = min(begin, iter->off[i].u >> 16);
+		end = max(end, (iter->off[i].v >> 16) + BGZF_MAX_BLOCK_SIZE);
+	}
+
+	const auto& [data, size] = mapped->second;
+	const uint64_t pageSize = sysconf(_SC_PAGESIZE);
+	begin -= begin % pageSize;
+	end = min<uint64_t>(end, size);
+	if (begin < end) madvise(data + begin, end - begin, MADV_WILLNEED);
+}
+
+void FM::setReference(const string& alignmentFile, const string& refGenFile) {
+	releaseReference();
+	refFileName = refGenFile;
+
+	samFile* in = openAlignment(alignmentFile);
+	if (in->format.format != cram) {
+		sam_close(in);
+		return;
+	}
+
+	//Every contig, and so every thread, opens its own handle of the alignment file, so one handle is kept alive to own
+	//the decoded reference and the others share it instead of each loading the FASTA again
+	refHolder = in;
+	sharedRefs = cram_get_refs(refHolder);
+}
+
+void FM::releaseReference() {
+	if (refHolder) sam_close(refHolder);
+	refHolder = nullptr;
+	sharedRefs = nullptr;
+}
+
+samFile* FM::openAlignment(const string& fileName) {
+	samFile* in = sam_open(fileName.c_str(), "r");
+	if (!in) {
+		cerr << "Error opening file " << fileName << endl;
+		throw runtime_error("Error opening file " + fileName);
+	}
+	if (in->format.format != cram) {
+		if (mappedInputs.find(fileName) != mappedInputs.end()) hts_set_opt(in, HTS_OPT_BLOCK_SIZE, MAPPED_INPUT_BLOCK_SIZE);
+		return in;
+	}
+
+	//CRAM stores the reads as differences against the reference, so the decoder needs the same FASTA the tool uses
+	if (sharedRefs) hts_set_opt(in, CRAM_OPT_SHARED_REF, sharedRefs);
+	else if (refFileName.empty() || hts_set_fai_filename(in, refFileName.c_str()) != 0) {
+		sam_close(in);
+		cerr << "Failed to set the reference genome for " << fileName << endl;
+		throw runtime_error("Failed to set the reference genome for " + fileName);
+	}
+
+	return in;
+}
 
 string FM::getRefGen(const string& fileName) {
 	string refGen;
@@ -34,6 +203,52 @@ string FM::getRefGen(const string& fileName) {
 	return refGen;
 }
 
+RefGenFile FM::openRefGen(const string& fileName) {
+	//The cache entry is held for the whole contig, so the windows neither stat the file nor take the cache lock
+	if (refGens.isEnabled()) {
+		return {fileName, nullptr, refGens.get(cacheKey(fileName), [&] {
+			return make_shared<const std::map<string, string>>(readRefGenContigs(fileName));
+		})};
+	}
+
+	faidx_t* fai = fai_load(fileName.c_str());
+	if (!fai) {
+		cerr << "Failed to load the index of " << fileName << endl;
+		throw runtime_error("Failed to load the index of " + fileName);
+	}
+
+	return {fileName, shared_ptr<faidx_t>(fai, fai_destroy), nullptr};
+}
+
+string FM::getRefGenSlice(
+	const RefGenFile& refGen,
+	const string& refName,
+	const size_t& from,
+	const size_t& to
+) {
+	if (refGen.contigs) {
+		const auto contig = refGen.contigs->find(refName);
+		if (contig == refGen.contigs->end() || from > contig->second.size()) {
+			cerr << "Failed to read " << refName << " from " << refGen.fileName << endl;
+			throw runtime_error("Failed to read " + refName + " from " + refGen.fileName);
+		}
+
+		return contig->second.substr(from, to - from);
+	}
+
+	hts_pos_t len = 0;
+	char* seq = faidx_fetch_seq64(refGen.fai.get(), refName.c_str(), from, to - 1, &len);
+	if (!seq || len < 0) {
+		cerr << "Failed to read " << refName << " from " << refGen.fileName << endl;
+		throw runtime_error("Failed to read " + refName + " from " + refGen.fileName);
+	}
+
+	string slice(seq, len);
+	free(seq);
+
+	return slice;
+}
+
 string FM::formFullPath(const string& fileName) {
 	return filesystem::current_path().parent_path().string() + '/' + fileName;
 }
@@ -52,6 +267,111 @@ CigarString FM::getCigarString(const bam1_t* b) {
 	return cigarData;
 }
 
+void FM::saveToBcf(
+	const string& fileName,
+	const string& refGenFile,
+	const string& sampleName,
+	const vector<pair<string, size_t>>& contigs,
+	const std::map<string, Mutations>& calls
+) {
+	TRACE_SPAN("saveToBcf");
+	faidx_t* fai = fai_load(refGenFile.c_str());
+	htsFile* fp = hts_open(fileName.c_str(), "wb");
+	if (!fai || !fp) {
+		if (fai) fai_destroy(fai);
+		if (fp) hts_close(fp);
+		cerr << "Failed to open the file " << fileName << endl;
+		throw runtime_error("Failed to open the file " + fileName);
+	}
+
+	bcf_hdr_t* hdr = bcf_hdr_init("w");
+	bcf_hdr_append(hdr, "##source=DetectingMutations");
+	for (const auto& [name, length] : contigs) {
+		bcf_hdr_append(hdr, ("##contig=<ID=" + name + ",length=" + std::to_string(length) + ">").c_str());
+	}
+	bcf_hdr_append(hdr, "##INFO=<ID=DP,Number=1,Type=Integer,Description=\"Number of reads covering the position\">");
+	bcf_hdr_append(hdr, "##FORMAT=<ID=NC,Number=5,Type=Integer,Description=\"Number of reads with -, A, C, G, T\">");
+	bcf_hdr_add_sample(hdr, sampleName.c_str());
+	bcf_hdr_sync(hdr);
+
+	//The CSI index is built while the records are written, so they have to come sorted by contig and position
+	const string indexName = fileName + ".csi";
+	if (bcf_hdr_write(fp, hdr) != 0 || bcf_idx_init(fp, hdr, 14, indexName.c_str()) != 0) {
+		bcf_hdr_destroy(hdr);
+		hts_close(fp);
+		fai_destroy(fai);
+		error_code error;
+		filesystem::remove(fileName, error);
+		cerr << "Failed to write the header of " << fileName << endl;
+		throw runtime_error("Failed to write the header of " + fileName);
+	}
+
+	bcf1_t* rec = bcf_init();
+	//A failed record stops the writing, and the partial file is removed along with its index
+	string failure;
+	for (const auto& [name, length] : contigs) {
+		if (!failure.empty()) break;
+		if (calls.find(name) == calls.end()) continue;
+
+		for (const auto& [pos, vec] : calls.at(name)) {
+			if (!failure.empty()) break;
+			//Deletions and insertions are anchored at the preceding base, as in the VCF produced by FreeBayes
+			const size_t anchorPos = pos == 0 ? 0 : pos - 1;
+			hts_pos_t len = 0;
+			char* seq = faidx_fetch_seq64(fai, name.c_str(), anchorPos, pos + 1, &len);
+			string refBases = seq ? string(seq, len) : string();
+			free(seq);
+			for (auto& aux : refBases) aux = static_cast<char>(toupper(aux));
+			if (refBases.empty()) continue;
+
+			const char anchor = refBases[0];
+			const char base = refBases.size() > pos - anchorPos ? refBases[pos - anchorPos] : 'N';
+			for (const auto& [symbol, action, counter] : vec) {
+				string alleles;
+				size_t recPos = pos;
+				if (action == 'X') alleles = string(1, base) + "," + symbol;
+				else if (action == 'D') {
+					recPos = anchorPos;
+					alleles = pos == 0 ? refBases.substr(0, 2) + "," + refBases.substr(1, 1) : string({anchor, base, ',', anchor});
+				} else {
+					recPos = anchorPos;
+					alleles = pos == 0 ? string({anchor, ',', symbol, anchor}) : string({anchor, ',', anchor, symbol});
+				}
+
+				bcf_clear(rec);
+				rec->rid = bcf_hdr_name2id(hdr, name.c_str());
+				rec->pos = recPos;
+				bcf_float_set_missing(rec->qual);
+
+				const int32_t depth = counter.size();
+				vector<int32_t> counts(counter.getCounters().begin(), counter.getCounters().end());
+				if (bcf_update_alleles_str(hdr, rec, alleles.c_str()) != 0 ||
+					bcf_update_info_int32(hdr, rec, "DP", &depth, 1) != 0 ||
+					bcf_update_format_int32(hdr, rec, "NC", counts.data(), counts.size()) != 0 ||
+					bcf_write(fp, hdr, rec) != 0) {
+					failure = "Failed to write the record at " + name + ":" + std::to_string(recPos + 1);
+					break;
+				}
+			}
+		}
+	}
+
+	if (failure.empty() && bcf_idx_save(fp) != 0) cerr << "Failed to save the index " << indexName << endl;
+
+	bcf_destroy(rec);
+	bcf_hdr_destroy(hdr);
+	if (hts_close(fp) != 0 && failure.empty()) failure = "Failed to write " + fileName;
+	fai_destroy(fai);
+
+	if (!failure.empty()) {
+		error_code error;
+		filesystem::remove(fileName, error);
+		filesystem::remove(indexName, error);
+		cerr << failure << endl;
+		throw runtime_error(failure);
+	}
+}
+
 MutationsVCF FM::getVCFInsertions(const string& ref, const string& alt, const size_t& pos) {
 	MutationsVCF indels;
 
@@ -118,6 +438,7 @@ string FM::getExpandedRead(string read, CigarString& cigar) {
 }
 
 void FM::saveToCsv(const string& geneName, CompRes& errors, const size_t& reportedErrorsVCF) {
+	TRACE_SPAN("saveToCsv");
 	std::map<size_t, set<string>> indices;
 
 	for (const auto& aux : errors.diffInVCF) {
@@ -147,10 +468,12 @@ void FM::saveToCsv(const string& geneName, CompRes& errors, const size_t& report
 
 	ofstream csvOut(FM::formFullPath(geneName + ".csv"));
 	csvOut << "Errors reported by FreeBayes, Missed + Errors fraction, Missed, Additional, Errors" << endl;
-	csvOut << reportedErrorsVCF << ", " << round(nErrors * 10000.0 / reportedErrorsVCF) / 10000.0 << ", " << errors.diffInVCF.size() << ", " << errors.diffInCust.size() << ", " << errors.errors.size() << ", " << endl;
+	//A contig without any VCF records (a plasmid FreeBayes has nothing to report for) has nothing to miss either
+	const double fraction = reportedErrorsVCF == 0 ? 0 : round(nErrors * 10000.0 / reportedErrorsVCF) / 10000.0;
+	csvOut << reportedErrorsVCF << ", " << fraction << ", " << errors.diffInVCF.size() << ", " << errors.diffInCust.size() << ", " << errors.errors.size() << ", " << endl;
 
 	csvOut << "Type, Index, Action, Symbol, ";
-	for (const auto& [fst, snd] : nucleoMapping) csvOut << fst << ", ";
+	for (const char symbol : NucleoCounter::alphabet::symbols) csvOut << symbol << ", ";
 	csvOut << "Expected Action, Expected Nucleo" << endl;
 
 	for (const auto& [fst, snd] : indices) {
@@ -159,7 +482,496 @@ void FM::saveToCsv(const string& geneName, CompRes& errors, const size_t& report
 	csvOut.close();
 }
 
-MutationsVCF FM::readFreeBayesVCF(const string& fileName, size_t& reportedErrorsVCF) {
+void FM::writeShardRow(
+	ofstream& out,
+	const char& type,
+	const size_t& pos,
+	const char& symbol,
+	const char& action,
+	const NucleoCounter& counter
+) {
+	//Symbols are stored as their codes since the VCF insertion symbols are not guaranteed to be printable
+	out << type << " " << pos << " " << int(symbol) << " " << int(action);
+	for (const auto aux : counter.getCounters()) out << " " << aux;
+}
+
+NucleoCounter FM::readShardCounter(istringstream& in) {
+	NucleoCounter counter;
+	for (const char symbol : NucleoCounter::alphabet::symbols) {
+		size_t value;
+		in >> value;
+		counter.setCounter(symbol, value);
+	}
+
+	return counter;
+}
+
+void FM::saveCappedDepths(const string& fileName, const std::map<size_t, size_t>& cappedDepths,
+                          const size_t& maxDepth) {
+	ofstream csvOut(fileName);
+	csvOut << "Index, Depth, Analysed" << endl;
+	for (const auto& [pos, depth] : cappedDepths) csvOut << pos << ", " << depth << ", " << maxDepth << endl;
+	csvOut.close();
+}
+
+void FM::saveAgreements(const string& fileName, const Agreements& agreements) {
+	std::array<size_t, Sources::classes.size()> counts{};
+	size_t nCalls = 0, nVCF = 0, nTruth = 0;
+	for (const auto& aux : agreements) {
+		const uint8_t mask = std::get<3>(aux);
+		counts[mask]++;
+		nCalls += (mask & Sources::calls) != 0;
+		nVCF += (mask & Sources::vcf) != 0;
+		nTruth += (mask & Sources::truth) != 0;
+	}
+
+	ofstream csvOut(fileName);
+	csvOut << "Ours, FreeBayes, Truth";
+	for (size_t i = 1; i != Sources::classes.size(); i++) csvOut << ", " << Sources::classes[i];
+	csvOut << endl << nCalls << ", " << nVCF << ", " << nTruth;
+	for (size_t i = 1; i != counts.size(); i++) csvOut << ", " << counts[i];
+	csvOut << endl;
+
+	csvOut << "Index, Action, Symbol, Class" << endl;
+	for (const auto& aux : agreements) {
+		csvOut << std::get<0>(aux) << ", " << std::get<2>(aux) << ", " << std::get<1>(aux) << ", " <<
+			Sources::classes[std::get<3>(aux)] << endl;
+	}
+	csvOut.close();
+}
+
+void FM::saveShard(
+	const string& fileName,
+	const string& geneName,
+	const size_t& from,
+	const size_t& to,
+	const size_t& refGenLen,
+	const size_t& windowSize,
+	const CompRes& res,
+	const size_t& reportedErrorsVCF
+) {
+	TRACE_SPAN("saveShard");
+	ofstream out(fileName);
+	out << "DetectingMutations shard" << endl;
+	out << "gene " << geneName << endl;
+	out << "region " << from << " " << to << " " << refGenLen << endl;
+	out << "window " << windowSize << endl;
+	//The counts are only merged by a build with counters of the same width, so that none of them is cut
+	out << "counter " << sizeof(NucleoCounter::counter) << endl;
+	out << "reported " << reportedErrorsVCF << endl;
+	out << "counts " << res.diffInVCF.size() << " " << res.diffInCust.size() << " " << res.errors.size() << endl;
+
+	for (const auto& aux : res.diffInVCF) {
+		writeShardRow(out, 'M', std::get<0>(aux), std::get<1>(aux), std::get<2>(aux), std::get<3>(aux));
+		out << endl;
+	}
+	for (const auto& aux : res.diffInCust) {
+		writeShardRow(out, 'A', std::get<0>(aux), std::get<1>(aux), std::get<2>(aux), std::get<3>(aux));
+		out << endl;
+	}
+	for (const auto& aux : res.errors) {
+		writeShardRow(out, 'E', std::get<0>(aux), std::get<1>(aux), std::get<2>(aux), std::get<5>(aux));
+		out << " " << int(std::get<3>(aux)) << " " << int(std::get<4>(aux)) << endl;
+	}
+	out.close();
+}
+
+void FM::mergeShards(const vector<string>& fileNames) {
+	//Shards are keyed by their starting position so that they can be passed in any order
+	std::map<size_t, pair<size_t, CompRes>> shards;
+	string geneName;
+	size_t refGenLen = 0;
+	size_t windowSize = 0;
+	size_t reportedErrorsVCF = 0;
+
+	for (const auto& fileName : fileNames) {
+		ifstream fin(fileName);
+		string line;
+		if (!getline(fin, line) || line != "DetectingMutations shard") {
+			cerr << "Not a shard file " << fileName << endl;
+			throw runtime_error("Not a shard file " + fileName);
+		}
+
+		string key, shardGene;
+		size_t from, to, shardLen, shardWindow, shardWidth, shardReported, nMissed, nAdditional, nErrors;
+		fin >> key >> shardGene >> key >> from >> to >> shardLen >> key >> shardWindow >> key >> shardWidth >> key >>
+			shardReported >> key >> nMissed >> nAdditional >> nErrors;
+		getline(fin, line);
+		if (!fin) {
+			cerr << "Not a shard file " << fileName << endl;
+			throw runtime_error("Not a shard file " + fileName);
+		}
+		if (shardWidth != sizeof(NucleoCounter::counter)) {
+			cerr << "Shard " << fileName << " has " << shardWidth << "-byte counters, this build has "
+			     << sizeof(NucleoCounter::counter) << "-byte ones" << endl;
+			throw runtime_error("Shard " + fileName + " has counters of a different width");
+		}
+
+		if (geneName.empty()) {
+			geneName = shardGene;
+			refGenLen = shardLen;
+			windowSize = shardWindow;
+			reportedErrorsVCF = shardReported;
+		} else if (shardGene != geneName || shardLen != refGenLen || shardWindow != windowSize ||
+			shardReported != reportedErrorsVCF) {
+			cerr << "Shard " << fileName << " belongs to a different run" << endl;
+			throw runtime_error("Shard " + fileName + " belongs to a different run");
+		}
+
+		CompRes res;
+		while (getline(fin, line)) {
+			istringstream row(line);
+			char type;
+			size_t pos;
+			int symbol, action;
+			row >> type >> pos >> symbol >> action;
+			NucleoCounter counter = readShardCounter(row);
+
+			if (type == 'M') res.diffInVCF.emplace_back(pos, symbol, action, counter);
+			else if (type == 'A') res.diffInCust.emplace_back(pos, symbol, action, counter);
+			else {
+				int custSymbol, custAction;
+				row >> custSymbol >> custAction;
+				res.errors.emplace_back(pos, symbol, action, custSymbol, custAction, counter);
+			}
+		}
+		fin.close();
+
+		if (res.diffInVCF.size() != nMissed || res.diffInCust.size() != nAdditional || res.errors.size() != nErrors) {
+			cerr << "Shard " << fileName << " is truncated" << endl;
+			throw runtime_error("Shard " + fileName + " is truncated");
+		}
+		if (!shards.emplace(from, make_pair(to, std::move(res))).second) {
+			cerr << "Shard starting at " << from << " is given more than once" << endl;
+			throw runtime_error("Shard starting at " + std::to_string(from) + " is given more than once");
+		}
+	}
+
+	//The shards have to tile the whole reference genome without gaps or overlaps
+	CompRes res;
+	size_t covered = 0;
+	for (auto& [from, shard] : shards) {
+		if (from != covered) {
+			cerr << "Shards do not cover the region starting at " << covered << endl;
+			throw runtime_error("Shards do not cover the region starting at " + std::to_string(covered));
+		}
+		res.merge(std::move(shard.second));
+		covered = shard.first;
+	}
+	if (shards.empty() || covered < refGenLen) {
+		cerr << "Shards do not cover the region starting at " << covered << endl;
+		throw runtime_error("Shards do not cover the region starting at " + std::to_string(covered));
+	}
+
+	saveToCsv(geneName, res, reportedErrorsVCF);
+}
+
+//The checkpoints are stored in the byte order of the machine, as they are only meant to be resumed on the same one
+#define CHECKPOINT_MAGIC "DMCKPT04"
+
+void FM::writeNumber(ostream& out, const uint64_t& value) {
+	out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+uint64_t FM::readNumber(istream& in) {
+	uint64_t value = 0;
+	in.read(reinterpret_cast<char*>(&value), sizeof(value));
+	return value;
+}
+
+void FM::writeString(ostream& out, const string& value) {
+	writeNumber(out, value.size());
+	out.write(value.data(), value.size());
+}
+
+//A corrupt size is never allocated up front, the string only grows as far as the file actually goes
+string FM::readString(istream& in) {
+	const uint64_t size = readNumber(in);
+
+	string value;
+	for (uint64_t left = size; in && left != 0;) {
+		const size_t chunk = min<uint64_t>(left, 1 << 20);
+		const size_t offset = value.size();
+		value.resize(offset + chunk);
+		in.read(value.data() + offset, chunk);
+		left -= chunk;
+	}
+	return in ? value : "";
+}
+
+//Counters are stored as wide as the build has them rather than widened to 64 bits, the width is checked on loading
+void FM::writeCounter(ostream& out, const NucleoCounter& counter) {
+	const auto& counters = counter.getCounters();
+	out.write(reinterpret_cast<const char*>(counters.data()), sizeof(counters));
+}
+
+NucleoCounter FM::readCounter(istream& in) {
+	auto counters = NucleoCounter().getCounters();
+	in.read(reinterpret_cast<char*>(counters.data()), sizeof(counters));
+
+	NucleoCounter counter;
+	for (size_t i = 0; i != counters.size(); i++) counter.setCounter(NucleoCounter::alphabet::symbols[i], counters[i]);
+	return counter;
+}
+
+void FM::writeResults(ostream& out, const Checkpoint& checkpoint) {
+	//Symbols and actions are single bytes
+	for (const auto* diff : {&checkpoint.res.diffInVCF, &checkpoint.res.diffInCust}) {
+		writeNumber(out, diff->size());
+		for (const auto& [pos, symbol, action, counter] : *diff) {
+			writeNumber(out, pos);
+			out.put(symbol).put(action);
+			writeCounter(out, counter);
+		}
+	}
+	writeNumber(out, checkpoint.res.errors.size());
+	for (const auto& [pos, symbol, action, expectedSymbol, expectedAction, counter] : checkpoint.res.errors) {
+		writeNumber(out, pos);
+		out.put(symbol).put(action).put(expectedSymbol).put(expectedAction);
+		writeCounter(out, counter);
+	}
+
+	writeNumber(out, checkpoint.calls.size());
+	for (const auto& [pos, vec] : checkpoint.calls) {
+		writeNumber(out, pos);
+		writeNumber(out, vec.size());
+		for (const auto& [symbol, action, counter] : vec) {
+			out.put(symbol).put(action);
+			writeCounter(out, counter);
+		}
+	}
+
+	writeNumber(out, checkpoint.cappedDepths.size());
+	for (const auto& [pos, depth] : checkpoint.cappedDepths) {
+		writeNumber(out, pos);
+		writeNumber(out, depth);
+	}
+
+	writeNumber(out, checkpoint.agreements.size());
+	for (const auto& [pos, symbol, action, mask] : checkpoint.agreements) {
+		writeNumber(out, pos);
+		out.put(symbol).put(action).put(mask);
+	}
+}
+
+void FM::readResults(istream& in, Checkpoint& checkpoint) {
+	for (auto* diff : {&checkpoint.res.diffInVCF, &checkpoint.res.diffInCust}) {
+		for (uint64_t n = readNumber(in); in && n != 0; n--) {
+			const size_t pos = readNumber(in);
+			const char symbol = in.get();
+			const char action = in.get();
+			diff->emplace_back(pos, symbol, action, readCounter(in));
+		}
+	}
+	for (uint64_t n = readNumber(in); in && n != 0; n--) {
+		const size_t pos = readNumber(in);
+		char symbols[4];
+		in.read(symbols, 4);
+		checkpoint.res.errors.emplace_back(pos, symbols[0], symbols[1], symbols[2], symbols[3], readCounter(in));
+	}
+
+	for (uint64_t n = readNumber(in); in && n != 0; n--) {
+		auto& vec = checkpoint.calls[readNumber(in)];
+		for (uint64_t m = readNumber(in); in && m != 0; m--) {
+			const char symbol = in.get();
+			const char action = in.get();
+			vec.emplace_back(symbol, action, readCounter(in));
+		}
+	}
+
+	for (uint64_t n = readNumber(in); in && n != 0; n--) {
+		const size_t pos = readNumber(in);
+		checkpoint.cappedDepths[pos] = readNumber(in);
+	}
+
+	for (uint64_t n = readNumber(in); in && n != 0; n--) {
+		const size_t pos = readNumber(in);
+		char aux[3];
+		in.read(aux, 3);
+		checkpoint.agreements.emplace_back(pos, aux[0], aux[1], aux[2]);
+	}
+}
+
+//The state is written next to the previous one and renamed over it, so that a run killed while writing it still has
+//the previous one. The results are appended to the ones saved before instead, so that every save costs only the
+//windows since the previous one rather than the whole run so far
+void FM::saveCheckpoint(const string& fileName, const string& runKey, Checkpoint& checkpoint) {
+	TRACE_SPAN("saveCheckpoint");
+	//Whatever follows the results of the previous state has been left by a run killed while saving, and is dropped
+	const string resultsFileName = fileName + ".results";
+	if (error_code error; filesystem::exists(resultsFileName, error)) {
+		filesystem::resize_file(resultsFileName, checkpoint.resultsSize);
+	}
+	ofstream results(resultsFileName, ios::binary | ios::app);
+	writeResults(results, checkpoint);
+	results.close();
+	if (!results) {
+		cerr << "Failed to write the checkpoint " << resultsFileName << endl;
+		throw runtime_error("Failed to write the checkpoint " + resultsFileName);
+	}
+	checkpoint.resultsSize = filesystem::file_size(resultsFileName);
+
+	const string tmpFileName = fileName + ".tmp";
+	ofstream out(tmpFileName, ios::binary);
+	out.write(CHECKPOINT_MAGIC, strlen(CHECKPOINT_MAGIC));
+	writeNumber(out, sizeof(NucleoCounter::counter));
+	writeString(out, runKey);
+	writeNumber(out, checkpoint.resultsSize);
+	writeNumber(out, checkpoint.windowStartInd);
+	writeNumber(out, checkpoint.isFinished);
+
+	writeNumber(out, checkpoint.cigarIndices.size());
+	for (const auto& [name, indices] : checkpoint.cigarIndices) {
+		writeString(out, name);
+		writeNumber(out, std::get<0>(indices));
+		writeNumber(out, std::get<1>(indices));
+		writeNumber(out, std::get<2>(indices));
+	}
+
+	writeNumber(out, checkpoint.nextWindowInsertions.size());
+	for (const auto& [pos, insertion] : checkpoint.nextWindowInsertions) {
+		writeNumber(out, pos);
+		writeCounter(out, insertion.first);
+		writeNumber(out, insertion.second.size());
+		for (const auto& name : insertion.second) writeString(out, name);
+	}
+
+	writeNumber(out, checkpoint.reads.size());
+	for (const auto& [startPos, sequence, rank] : checkpoint.reads) {
+		writeNumber(out, startPos);
+		writeString(out, sequence);
+		writeNumber(out, rank);
+	}
+	writeNumber(out, checkpoint.droppedEnds.size());
+	for (const auto& [pos, n] : checkpoint.droppedEnds) {
+		writeNumber(out, pos);
+		writeNumber(out, n);
+	}
+
+	writeNumber(out, checkpoint.nonErrors.size());
+	for (const auto& [pos, counter] : checkpoint.nonErrors) {
+		writeNumber(out, pos);
+		writeCounter(out, counter);
+	}
+
+	out.close();
+	if (!out) {
+		cerr << "Failed to write the checkpoint " << tmpFileName << endl;
+		throw runtime_error("Failed to write the checkpoint " + tmpFileName);
+	}
+	filesystem::rename(tmpFileName, fileName);
+}
+
+//Returns false if there is no checkpoint to continue from
+bool FM::loadCheckpoint(const string& fileName, const string& runKey, Checkpoint& checkpoint) {
+	ifstream in(fileName, ios::binary);
+	if (!in.is_open()) return false;
+
+	string magic(strlen(CHECKPOINT_MAGIC), '\0');
+	in.read(magic.data(), magic.size());
+	if (!in || magic != CHECKPOINT_MAGIC) {
+		cerr << fileName << " is not a checkpoint" << endl;
+		throw runtime_error(fileName + " is not a checkpoint");
+	}
+	if (const uint64_t width = readNumber(in); width != sizeof(NucleoCounter::counter)) {
+		cerr << "The checkpoint " << fileName << " has " << width << "-byte counters, this build has "
+		     << sizeof(NucleoCounter::counter) << "-byte ones" << endl;
+		throw runtime_error("The checkpoint " + fileName + " has counters of a different width");
+	}
+	const string savedRunKey = readString(in);
+	if (!in) {
+		cerr << "The checkpoint " << fileName << " is truncated" << endl;
+		throw runtime_error("The checkpoint " + fileName + " is truncated");
+	}
+	if (savedRunKey != runKey) {
+		cerr << "The checkpoint " << fileName << " belongs to a different run" << endl;
+		throw runtime_error("The checkpoint " + fileName + " belongs to a different run");
+	}
+
+	checkpoint = Checkpoint();
+	checkpoint.resultsSize = readNumber(in);
+	checkpoint.windowStartInd = readNumber(in);
+	checkpoint.isFinished = readNumber(in);
+
+	for (uint64_t n = readNumber(in); in && n != 0; n--) {
+		const string name = readString(in);
+		const size_t first = readNumber(in);
+		const size_t second = readNumber(in);
+		checkpoint.cigarIndices[name] = {first, second, readNumber(in)};
+	}
+
+	for (uint64_t n = readNumber(in); in && n != 0; n--) {
+		auto& insertion = checkpoint.nextWindowInsertions[readNumber(in)];
+		insertion.first = readCounter(in);
+		for (uint64_t m = readNumber(in); in && m != 0; m--) insertion.second.insert(readString(in));
+	}
+
+	for (uint64_t n = readNumber(in); in && n != 0; n--) {
+		const size_t startPos = readNumber(in);
+		string sequence = readString(in);
+		checkpoint.reads.emplace_back(startPos, std::move(sequence), readNumber(in));
+	}
+	for (uint64_t n = readNumber(in); in && n != 0; n--) {
+		const size_t pos = readNumber(in);
+		checkpoint.droppedEnds[pos] = readNumber(in);
+	}
+
+	for (uint64_t n = readNumber(in); in && n != 0; n--) {
+		const size_t pos = readNumber(in);
+		checkpoint.nonErrors[pos] = readCounter(in);
+	}
+
+	//The results are the segments appended by every save up to this state, anything after them is ignored
+	ifstream results(fileName + ".results", ios::binary);
+	while (in && results && static_cast<uint64_t>(results.tellg()) < checkpoint.resultsSize) {
+		readResults(results, checkpoint);
+	}
+
+	if (!in || !results || static_cast<uint64_t>(results.tellg()) != checkpoint.resultsSize) {
+		cerr << "The checkpoint " << fileName << " is truncated" << endl;
+		throw runtime_error("The checkpoint " + fileName + " is truncated");
+	}
+
+	return true;
+}
+
+//Reads the simulated mutations in the "type,pos,base" format (0-based positions, '-' as the base of the deletions),
+//the same way readFreeBayesVCF stores the VCF ones
+MutationsVCF FM::readGroundTruth(const string& fileName) {
+	ifstream in(fileName);
+	if (!in.is_open()) {
+		cerr << "Failed to open the file " << fileName << endl;
+		throw runtime_error("Failed to open the file " + fileName);
+	}
+
+	MutationsVCF mutations;
+	string line;
+	for (size_t lineNum = 1; getline(in, line); lineNum++) {
+		if (!line.empty() && line.back() == '\r') line.pop_back();
+		if (line.empty() || (lineNum == 1 && line.rfind("type", 0) == 0)) continue;
+
+		const size_t first = line.find(',');
+		const size_t second = first == string::npos ? string::npos : line.find(',', first + 1);
+		size_t pos = 0;
+		bool isParsed = first == 1 && second != string::npos && second + 2 == line.size() &&
+			(line[0] == 'X' || line[0] == 'D' || line[0] == 'I');
+		try {
+			if (isParsed) pos = stoul(line.substr(first + 1, second - first - 1));
+		} catch (const exception&) {
+			isParsed = false;
+		}
+		if (!isParsed) {
+			cerr << "Malformed line " << lineNum << " of " << fileName << ": " << line << endl;
+			throw runtime_error("Malformed line " + std::to_string(lineNum) + " of " + fileName);
+		}
+
+		mutations[pos].emplace_back(line.back(), line[0]);
+	}
+
+	return mutations;
+}
+
+std::map<string, MutationsVCF> FM::readFreeBayesVCF(const string& fileName, std::map<string, size_t>& reportedErrorsVCF) {
 	htsFile* fp = bcf_open(fileName.c_str(), "r");
 	if (!fp) {
 		cerr << "Failed to open the file " << fileName << endl;
@@ -169,10 +981,13 @@ MutationsVCF FM::readFreeBayesVCF(const string& fileName, size_t& reportedErrors
 	bcf_hdr_t* hdr = bcf_hdr_read(fp);
 	bcf1_t* rec = bcf_init();
 
-	MutationsVCF mutations;
+	std::map<string, MutationsVCF> contigMutations;
 	while (bcf_read(fp, hdr, rec) == 0) {
 		bcf_unpack(rec, BCF_UN_STR);
 
+		const string contig = bcf_hdr_id2name(hdr, rec->rid);
+		MutationsVCF& mutations = contigMutations[contig];
+
 		int pos = rec->pos;
 
 		// REF allele is first allele
@@ -195,7 +1010,7 @@ MutationsVCF FM::readFreeBayesVCF(const string& fileName, size_t& reportedErrors
 			else if (refLen > altLen) mutations[pos + 1].emplace_back('-', 'D');
 			else if (refLen < altLen) mutations.merge(getVCFInsertions(ref, alt, pos + 1));
 		}
-		reportedErrorsVCF++;
+		reportedErrorsVCF[contig]++;
 	}
 
 	// Cleanup
@@ -203,160 +1018,300 @@ MutationsVCF FM::readFreeBayesVCF(const string& fileName, size_t& reportedErrors
 	bcf_hdr_destroy(hdr);
 	bcf_close(fp);
 
-	return mutations;
+	return contigMutations;
 }
 
-size_t FM::getRefGenLength(const string& fileName) {
-	samFile* in = sam_open(fileName.c_str(), "r");
-	if (!in) {
-		cerr << "Error opening file " << fileName << endl;
-		throw runtime_error("Error opening file " + fileName);
-	}
-
+vector<pair<string, size_t>> FM::getRefGenContigs(const string& fileName) {
+	samFile* in = openAlignment(fileName);
 	bam_hdr_t* header = sam_hdr_read(in);
-	const size_t refLen = header->target_len[0];
+
+	vector<pair<string, size_t>> contigs;
+	for (int32_t i = 0; i < header->n_targets; i++) contigs.emplace_back(header->target_name[i], header->target_len[i]);
 
 	bam_hdr_destroy(header);
 	sam_close(in);
 
-	return refLen;
+	return contigs;
 }
 
-string FM::getRefGenName(const string& fileName) {
-	samFile* in = sam_open(fileName.c_str(), "r");
-	if (!in) {
-		cerr << "Error opening file " << fileName << endl;
-		throw runtime_error("Error opening file " + fileName);
-	}
-
+shared_ptr<const AlignmentFile> FM::openAlignmentFile(const string& fileName) {
+	samFile* in = openAlignment(fileName);
 	bam_hdr_t* header = sam_hdr_read(in);
-	const string refName = header->target_name[0];
+	if (!header) {
+		sam_close(in);
+		cerr << "Failed to read the header of " << fileName << endl;
+		throw runtime_error("Failed to read the header of " + fileName);
+	}
 
-	bam_hdr_destroy(header);
-	sam_close(in);
+	shared_ptr<const hts_idx_t> idx;
+	try {
+		//Picks up .bai/.csi for BAM and .crai for CRAM
+		idx = loadIndex(in, fileName);
+	} catch (...) {
+		bam_hdr_destroy(header);
+		sam_close(in);
+		throw;
+	}
 
-	return refName;
+	return shared_ptr<const AlignmentFile>(new AlignmentFile{fileName, in, header, std::move(idx)},
+	                                       [](const AlignmentFile* aux) {
+		                                       bam_hdr_destroy(aux->header);
+		                                       sam_close(aux->in);
+		                                       delete aux;
+	                                       });
 }
 
-AlignmentMaps FM::getAlignments(
-	const string& fileName,
-	const size_t& from,
-	const size_t& to,
-	const string& refName,
-	const InsertionMap& prevIterInsertions
-) {
-	samFile* in = sam_open(fileName.c_str(), "r");
-	bam_hdr_t* header = sam_hdr_read(in);
-	hts_idx_t* idx = sam_index_load(in, fileName.c_str());
-	hts_itr_t* iter = sam_itr_querys(idx, header,
-	                                 (refName + ":" + std::to_string(from) + "-" + std::to_string(to)).c_str());
+size_t FM::getFirstOverlappingStart(const AlignmentFile& file, const string& refName, const size_t& pos) {
+	//The window queries are inclusive of the position right before the window, so the same is covered here
+	hts_itr_t* iter = sam_itr_queryi(file.idx.get(), sam_hdr_name2tid(file.header, refName.c_str()),
+	                                 pos == 0 ? 0 : pos - 1, pos + 1);
 	bam1_t* b = bam_init1();
 
-	std::map<size_t, set<pair<string, string>>> startingPos;
-	Insertions insertions = Insertions(prevIterInsertions);
-
-	while (sam_itr_next(in, iter, b) >= 0) {
-		//Check whether the sequence has been aligned to the reference genome
+	size_t firstStart = pos;
+	while (sam_itr_next(file.in, iter, b) >= 0) {
 		if (b->core.flag & BAM_FUNMAP) continue;
+		firstStart = min(firstStart, static_cast<size_t>(b->core.pos));
+	}
 
-		size_t pos = b->core.pos;
-		string name = bam_get_qname(b);
-		CigarString cigarExpanded = getCigarString(b);
-
-		const string read = getRead(b);
-		//An empty read means that the read was matched at some other position
-		if (read.empty()) continue;
-		string expandedRead = getExpandedRead(read, cigarExpanded);
-
-		//Aligned position for the string with cut out insertions (for the direct substitution and deletion analysis)
-		size_t readSDStart = pos;
-		size_t startPos = pos;
-
-		// If we analyze parts of the string that are not within the window, we can find ourselves in the situation when indices are analyzed more than once with different content
-		// check whether the starting index is within the window
-		// if so, iterate over the cigar string clipping it in a way that would cover only the part of the read within the window
-		// store the index of the last analyzed element in the Cigar string
-		// if the starting index is not within the window check the array with stored indices in order to figure out what the position that should be started with and remove the index
-
-		size_t readOffset = 0;
-		size_t cigarOffset = 0;
-		if (cigarIndices.find(name) != cigarIndices.end()) {
-			const auto end = next(cigarExpanded.begin(), get<0>(cigarIndices[name]));
-			cigarExpanded.erase(cigarExpanded.begin(), end);
-			cigarExpanded.begin()->second -= get<1>(cigarIndices[name]);
-			expandedRead = expandedRead.substr(get<2>(cigarIndices[name]));
-			cigarOffset = get<0>(cigarIndices[name]);
-			readOffset = get<2>(cigarIndices[name]);
-			readSDStart = from;
-			startPos = from;
-
-			cigarIndices.erase(name);
-		} else if (startPos < from) continue;
-		if (expandedRead.empty()) continue;
-		//Since the insertions are cut out, if the first non-clipped part of the string requires an insertion
-		//the starting index should take that into consideration
-		if (cigarExpanded.begin()->first == 'I') readSDStart += cigarExpanded.begin()->second;
-		//Base index for the insertion - should take care of the potential clipping
-
-		size_t insertionsFound = 0;
-		string noInsertionsRead;
-		size_t readFromIndex = 0;
-		size_t curReadIndex = 0;
-
-		insertions.setRead(expandedRead, name);
-		for (auto cigarIter = cigarExpanded.begin(); cigarIter != cigarExpanded.end(); cigarIter++) {
-			const size_t refGenIndex = startPos - insertionsFound + curReadIndex;
-			const bool isInsertion = cigarIter->first == 'I';
-
-			//if we get out of the boundaries of the defined window
-			if (refGenIndex + cigarIter->second >= to) {
-				//We can cover the insertions even if they get out of the window as it does not increase the indices for S and D
-				const size_t left = to - refGenIndex;
-				const size_t end = isInsertion ? cigarIter->second : left;
-
-				if (isInsertion) {
-					noInsertionsRead += expandedRead.substr(readFromIndex, curReadIndex - readFromIndex);
-					readFromIndex = curReadIndex + cigarIter->second;
-				}
+	bam_destroy1(b);
+	hts_itr_destroy(iter);
 
-				insertions.addInsertion(refGenIndex, curReadIndex, end, left, isInsertion);
-				if (!isInsertion) {
-					//We want to store the position in the iteration string, length covered and position in the expanded string
-					//in order to start the analysis of the string within the next window quicker
-					cigarIndices[name] = make_tuple(distance(cigarExpanded.begin(), cigarIter) + cigarOffset, left,
-					                                curReadIndex + left + readOffset);
-					curReadIndex += left;
-					break;
-				}
+	return firstStart;
+}
 
-				insertionsFound += cigarIter->second;
-				curReadIndex += cigarIter->second;
-				continue;
+bool FM::parseAlignment(const bam1_t* b, AlignedRead& read) {
+	//Check whether the sequence has been aligned to the reference genome
+	if (b->core.flag & BAM_FUNMAP) return false;
+
+	const string sequence = getRead(b);
+	//An empty read means that the read was matched at some other position
+	if (sequence.empty()) return false;
+
+	read.pos = b->core.pos;
+	read.name = bam_get_qname(b);
+	read.cigar = getCigarString(b);
+	read.expandedRead = getExpandedRead(sequence, read.cigar);
+
+	//The inserted bases are counted past the position they are inserted at, so the read may reach a window starting
+	//after its last aligned base
+	size_t insertionsFound = 0;
+	size_t curReadIndex = 0;
+	read.endPos = read.pos;
+	for (const auto& [op, len] : read.cigar) {
+		read.endPos = max(read.endPos, read.pos - insertionsFound + curReadIndex + len);
+		if (op == 'I') insertionsFound += len;
+		curReadIndex += len;
+	}
+	return true;
+}
+
+//Stores the indices at which a read starting before from reaches it, the same ones a window ending at from would have
+//stored into cigarIndices, and hands the inserted bases reaching over from over the same way. Nothing is counted for
+//the positions before from. Returns false if the read ends before from
+bool FM::clipAt(const size_t& from, const AlignedRead& read, Insertions& insertions, CigarIndices& cigarIndices) {
+	size_t insertionsFound = 0;
+	size_t curReadIndex = 0;
+
+	insertions.setRead(read.expandedRead, read.name);
+	for (auto cigarIter = read.cigar.begin(); cigarIter != read.cigar.end(); cigarIter++) {
+		const size_t refGenIndex = read.pos - insertionsFound + curReadIndex;
+		const bool isInsertion = cigarIter->first == 'I';
+
+		if (refGenIndex + cigarIter->second >= from) {
+			const size_t left = from - refGenIndex;
+			if (!isInsertion) {
+				cigarIndices[read.name] = make_tuple(distance(read.cigar.begin(), cigarIter), left, curReadIndex + left);
+				return true;
 			}
+			insertions.addCarriedInsertion(refGenIndex, curReadIndex, left, cigarIter->second);
+		}
+
+		if (isInsertion) insertionsFound += cigarIter->second;
+		curReadIndex += cigarIter->second;
+	}
+
+	return false;
+}
+
+void FM::addAlignment(
+	AlignedRead read,
+	const size_t& from,
+	const size_t& to,
+	Alignments& startingPos,
+	Insertions& insertions,
+	CigarIndices& cigarIndices,
+	const bool isClippedAtFrom
+) {
+	const size_t pos = read.pos;
+	const string& name = read.name;
+	CigarString& cigarExpanded = read.cigar;
+	string& expandedRead = read.expandedRead;
+
+	//A read starting before a target is clipped to its start right away, as no earlier window has walked it
+	if (isClippedAtFrom && pos < from && cigarIndices.find(name) == cigarIndices.end() &&
+		!clipAt(from, read, insertions, cigarIndices)) return;
+
+	//Aligned position for the string with cut out insertions (for the direct substitution and deletion analysis)
+	size_t readSDStart = pos;
+	size_t startPos = pos;
+
+	// If we analyze parts of the string that are not within the window, we can find ourselves in the situation when indices are analyzed more than once with different content
+	// check whether the starting index is within the window
+	// if so, iterate over the cigar string clipping it in a way that would cover only the part of the read within the window
+	// store the index of the last analyzed element in the Cigar string
+	// if the starting index is not within the window check the array with stored indices in order to figure out what the position that should be started with and remove the index
+
+	size_t readOffset = 0;
+	size_t cigarOffset = 0;
+	if (cigarIndices.find(name) != cigarIndices.end()) {
+		const auto end = next(cigarExpanded.begin(), get<0>(cigarIndices[name]));
+		cigarExpanded.erase(cigarExpanded.begin(), end);
+		cigarExpanded.begin()->second -= get<1>(cigarIndices[name]);
+		expandedRead = expandedRead.substr(get<2>(cigarIndices[name]));
+		cigarOffset = get<0>(cigarIndices[name]);
+		readOffset = get<2>(cigarIndices[name]);
+		readSDStart = from;
+		startPos = from;
+
+		cigarIndices.erase(name);
+	} else if (startPos < from) return;
+	if (expandedRead.empty()) return;
+	//Since the insertions are cut out, if the first non-clipped part of the string requires an insertion
+	//the starting index should take that into consideration
+	if (cigarExpanded.begin()->first == 'I') readSDStart += cigarExpanded.begin()->second;
+	//Base index for the insertion - should take care of the potential clipping
+
+	size_t insertionsFound = 0;
+	string noInsertionsRead;
+	size_t readFromIndex = 0;
+	size_t curReadIndex = 0;
+
+	insertions.setRead(expandedRead, name);
+	for (auto cigarIter = cigarExpanded.begin(); cigarIter != cigarExpanded.end(); cigarIter++) {
+		const size_t refGenIndex = startPos - insertionsFound + curReadIndex;
+		const bool isInsertion = cigarIter->first == 'I';
+
+		//if we get out of the boundaries of the defined window
+		if (refGenIndex + cigarIter->second >= to) {
+			//We can cover the insertions even if they get out of the window as it does not increase the indices for S and D
+			const size_t left = to - refGenIndex;
+			const size_t end = isInsertion ? cigarIter->second : left;
 
 			if (isInsertion) {
 				noInsertionsRead += expandedRead.substr(readFromIndex, curReadIndex - readFromIndex);
 				readFromIndex = curReadIndex + cigarIter->second;
 			}
-			insertions.addInsertion(refGenIndex, curReadIndex, cigarIter->second, cigarIter->second, isInsertion);
 
-			if (isInsertion) insertionsFound += cigarIter->second;
+			insertions.addInsertion(refGenIndex, curReadIndex, end, left, isInsertion);
+			if (!isInsertion) {
+				//We want to store the position in the iteration string, length covered and position in the expanded string
+				//in order to start the analysis of the string within the next window quicker
+				cigarIndices[name] = make_tuple(distance(cigarExpanded.begin(), cigarIter) + cigarOffset, left,
+				                                curReadIndex + left + readOffset);
+				curReadIndex += left;
+				break;
+			}
+
+			insertionsFound += cigarIter->second;
 			curReadIndex += cigarIter->second;
+			continue;
 		}
 
-		//If the section before the end clipping is not an insertion one, the remaining string still needs to be read
-		if (readFromIndex != curReadIndex) noInsertionsRead += expandedRead.substr(
-			readFromIndex, curReadIndex - readFromIndex);
+		if (isInsertion) {
+			noInsertionsRead += expandedRead.substr(readFromIndex, curReadIndex - readFromIndex);
+			readFromIndex = curReadIndex + cigarIter->second;
+		}
+		insertions.addInsertion(refGenIndex, curReadIndex, cigarIter->second, cigarIter->second, isInsertion);
+
+		if (isInsertion) insertionsFound += cigarIter->second;
+		curReadIndex += cigarIter->second;
+	}
+
+	//If the section before the end clipping is not an insertion one, the remaining string still needs to be read
+	if (readFromIndex != curReadIndex) noInsertionsRead += expandedRead.substr(
+		readFromIndex, curReadIndex - readFromIndex);
+
+	// The BAM library stores the position for the aligned bases
+	startingPos[readSDStart].emplace(std::move(noInsertionsRead), name);
+}
+
+AlignmentMaps FM::getAlignments(
+	const AlignmentFile& file,
+	const size_t& from,
+	const size_t& to,
+	const string& refName,
+	InsertionMap prevIterInsertions,
+	CigarIndices& cigarIndices
+) {
+	TRACE_SPAN("getAlignments");
+	hts_itr_t* iter = sam_itr_querys(file.idx.get(), file.header,
+	                                 (refName + ":" + std::to_string(from) + "-" + std::to_string(to)).c_str());
+	bam1_t* b = bam_init1();
+
+	//The current window is needed right away and the next one is read ahead while this one is being analysed
+	if (mappedInputs.find(file.fileName) != mappedInputs.end()) {
+		adviseInput(file.fileName, iter);
+		hts_itr_t* nextIter = sam_itr_queryi(file.idx.get(), sam_hdr_name2tid(file.header, refName.c_str()), to,
+		                                     to + (to - from));
+		adviseInput(file.fileName, nextIter);
+		hts_itr_destroy(nextIter);
+	}
+
+	Alignments startingPos;
+	Insertions insertions(std::move(prevIterInsertions));
 
-		// The BAM library stores the position for the aligned bases
-		startingPos[readSDStart].insert(make_pair(noInsertionsRead, name));
+	AlignedRead read;
+	while (sam_itr_next(file.in, iter, b) >= 0) {
+		if (parseAlignment(b, read)) addAlignment(std::move(read), from, to, startingPos, insertions, cigarIndices);
 	}
 
 	bam_destroy1(b);
 	hts_itr_destroy(iter);
-	hts_idx_destroy(idx);
-	bam_hdr_destroy(header);
-	sam_close(in);
 
-	return {startingPos, insertions};
+	return {std::move(startingPos), std::move(insertions)};
+}
+
+shared_ptr<AlignmentSweep> FM::sweepAlignments(
+	const shared_ptr<const AlignmentFile>& file,
+	const string& refName,
+	const size_t& from,
+	const size_t& to
+) {
+	//Inclusive of the position right before from, like the window queries
+	hts_itr_t* iter = sam_itr_queryi(file->idx.get(), sam_hdr_name2tid(file->header, refName.c_str()),
+	                                 from == 0 ? 0 : from - 1, to);
+	if (!iter) {
+		cerr << "Failed to query " << refName << " of " << file->fileName << endl;
+		throw runtime_error("Failed to query " + refName + " of " + file->fileName);
+	}
+
+	return shared_ptr<AlignmentSweep>(new AlignmentSweep{file, iter, bam_init1()}, [](AlignmentSweep* aux) {
+		bam_destroy1(aux->b);
+		hts_itr_destroy(aux->iter);
+		delete aux;
+	});
+}
+
+AlignmentMaps FM::getTargetAlignments(AlignmentSweep& sweep, const size_t& from, const size_t& to) {
+	TRACE_SPAN("getTargetAlignments");
+	//Fetches up to the first read starting after the target, which is kept for the next ones
+	AlignedRead read;
+	while (!sweep.isFinished && (sweep.reads.empty() || sweep.reads.back().pos < to)) {
+		if (sam_itr_next(sweep.file->in, sweep.iter, sweep.b) < 0) sweep.isFinished = true;
+		else if (parseAlignment(sweep.b, read)) sweep.reads.push_back(std::move(read));
+	}
+	//The targets are sorted, so a read ending before this one ends before all the later ones as well
+	sweep.reads.erase(remove_if(sweep.reads.begin(), sweep.reads.end(), [&](const AlignedRead& aux) {
+		return aux.endPos < from;
+	}), sweep.reads.end());
+
+	Alignments startingPos;
+	Insertions insertions;
+	CigarIndices cigarIndices;
+	for (const auto& aux : sweep.reads) {
+		if (aux.pos >= to) break;
+		addAlignment(aux, from, to, startingPos, insertions, cigarIndices, true);
+	}
+
+	return {std::move(startingPos), std::move(insertions)};
 }
@@ -1,35 +1,160 @@
 #ifndef FILESREADER_H
 #define FILESREADER_H
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <sstream>
 #include <string>
 #include <boost/icl/interval_map.hpp>
+#include <htslib/cram.h>
+#include <htslib/faidx.h>
 #include <htslib/sam.h>
 
+#include "LruCache.h"
 #include "Structures.h"
 
 using namespace std;
 using namespace boost::icl;
 
+//Alignment file opened along with its header and index once per contig, every window or target of it is queried through
+//the same handle
+struct AlignmentFile {
+	const string fileName;
+	samFile* const in;
+	bam_hdr_t* const header;
+	const shared_ptr<const hts_idx_t> idx;
+};
+
+//Mapped read decoded once, kept by a sweep for as long as the targets may still reach it
+struct AlignedRead {
+	size_t pos = 0;
+	//Past the last position reached by the read, its inserted bases included
+	size_t endPos = 0;
+	string name;
+	CigarString cigar;
+	string expandedRead;
+};
+
+//Single iterator over the sorted targets of a contig, holding the reads fetched so far which end at or after the start
+//of the current target, in the order of the file
+struct AlignmentSweep {
+	const shared_ptr<const AlignmentFile> file;
+	hts_itr_t* const iter;
+	bam1_t* const b;
+	bool isFinished = false;
+	deque<AlignedRead> reads;
+};
+
+//Reference genome opened once per contig, either through its faidx (not shared between the threads) or as the contigs
+//cached by a long-running process, resolved once rather than for every window
+struct RefGenFile {
+	const string fileName;
+	const shared_ptr<faidx_t> fai;
+	const shared_ptr<const std::map<string, string>> contigs;
+};
+
 class FilesManipulator {
+	static string refFileName;
+	static samFile* refHolder;
+	static refs_t* sharedRefs;
+	//Memory-mapped local inputs (alignment file and its index) along with their sizes
+	static std::map<string, pair<char*, size_t>> mappedInputs;
+	//Inputs kept in memory between the jobs of a long-running process, keyed by the file name and modification time
+	static LruCache<string, const TruthSet> truthSets;
+	static LruCache<string, const std::map<string, string>> refGens;
+	static LruCache<string, const hts_idx_t> indices;
+
 	static MutationsVCF getVCFInsertions(const string& ref, const string& alt, const size_t& pos);
+	static samFile* openAlignment(const string& fileName);
+	static void adviseInput(const string& fileName, const hts_itr_t* iter);
+	static shared_ptr<const hts_idx_t> loadIndex(samFile* in, const string& fileName);
+	static std::map<string, string> readRefGenContigs(const string& fileName);
+	static void writeShardRow(ofstream& out, const char& type, const size_t& pos, const char& symbol, const char& action,
+	                          const NucleoCounter& counter);
+	static NucleoCounter readShardCounter(istringstream& in);
+	static void writeNumber(ostream& out, const uint64_t& value);
+	static uint64_t readNumber(istream& in);
+	static void writeString(ostream& out, const string& value);
+	static string readString(istream& in);
+	static void writeCounter(ostream& out, const NucleoCounter& counter);
+	static NucleoCounter readCounter(istream& in);
+	static void writeResults(ostream& out, const Checkpoint& checkpoint);
+	static void readResults(istream& in, Checkpoint& checkpoint);
+	static bool parseAlignment(const bam1_t* b, AlignedRead& read);
+	static bool clipAt(const size_t& from, const AlignedRead& read, Insertions& insertions, CigarIndices& cigarIndices);
+	static void addAlignment(
+		AlignedRead read,
+		const size_t& from,
+		const size_t& to,
+		Alignments& startingPos,
+		Insertions& insertions,
+		CigarIndices& cigarIndices,
+		const bool isClippedAtFrom = false
+	);
 
 public:
-	static std::map<std::string, std::tuple<size_t, size_t, size_t>> cigarIndices;
-
+	static shared_ptr<const AlignmentFile> openAlignmentFile(const string& fileName);
 	static AlignmentMaps getAlignments(
-		const string& fileName,
+		const AlignmentFile& file,
 		const size_t& from,
 		const size_t& to,
 		const string& refName,
-		const InsertionMap& prevIterInsertions
+		InsertionMap prevIterInsertions,
+		CigarIndices& cigarIndices
+	);
+	static shared_ptr<AlignmentSweep> sweepAlignments(
+		const shared_ptr<const AlignmentFile>& file,
+		const string& refName,
+		const size_t& from,
+		const size_t& to
 	);
-	static size_t getRefGenLength(const std::string& fileName);
-	static string getRefGenName(const string& fileName);
+	static AlignmentMaps getTargetAlignments(AlignmentSweep& sweep, const size_t& from, const size_t& to);
+	static void setReference(const string& alignmentFile, const string& refGenFile);
+	static void releaseReference();
+	static void mapInput(const string& fileName);
+	static void unmapInputs();
+	static void enableCaches(const size_t& capacity);
+	static string cacheKey(const string& fileName);
+	static shared_ptr<const TruthSet> getTruthSet(const string& fileName);
+	static vector<pair<string, size_t>> getRefGenContigs(const string& fileName);
+	static size_t getFirstOverlappingStart(const AlignmentFile& file, const string& refName, const size_t& pos);
 	static string getRefGen(const string& fileName);
-	static MutationsVCF readFreeBayesVCF(const string& fileName, size_t &reportedErrorsVCF);
+	static RefGenFile openRefGen(const string& fileName);
+	static string getRefGenSlice(
+		const RefGenFile& refGen,
+		const string& refName,
+		const size_t& from,
+		const size_t& to
+	);
+	static MutationsVCF readGroundTruth(const string& fileName);
+	static std::map<string, MutationsVCF> readFreeBayesVCF(const string& fileName, std::map<string, size_t>& reportedErrorsVCF);
 	static CigarString getCigarString(const bam1_t* b);
 	static string getRead(const bam1_t* b);
 	static string getExpandedRead(string read, CigarString& cigar);
 	static string formFullPath(const string& fileName);
 	static void saveToCsv(const string& geneName, CompRes& errors, const size_t &reportedErrorsVCF);
+	static void saveCappedDepths(const string& fileName, const std::map<size_t, size_t>& cappedDepths,
+	                             const size_t& maxDepth);
+	static void saveAgreements(const string& fileName, const Agreements& agreements);
+	static void saveShard(
+		const string& fileName,
+		const string& geneName,
+		const size_t& from,
+		const size_t& to,
+		const size_t& refGenLen,
+		const size_t& windowSize,
+		const CompRes& res,
+		const size_t& reportedErrorsVCF
+	);
+	static void mergeShards(const vector<string>& fileNames);
+	static void saveCheckpoint(const string& fileName, const string& runKey, Checkpoint& checkpoint);
+	static bool loadCheckpoint(const string& fileName, const string& runKey, Checkpoint& checkpoint);
+	static void saveToBcf(
+		const string& fileName,
+		const string& refGenFile,
+		const string& sampleName,
+		const vector<pair<string, size_t>>& contigs,
+		const std::map<string, Mutations>& calls
+	);
 };
 #endif //FILESREADER_H
@@ -0,0 +1,67 @@
+#ifndef LRUCACHE_H
+#define LRUCACHE_H
+
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+
+using namespace std;
+
+//Keeps the last used values, evicting the least recently used one once there are more than capacity of them.
+//Values are handed out as shared pointers, so an evicted value stays alive for as long as it is being used.
+//With zero capacity nothing is kept and every lookup loads the value anew
+template <typename Key, typename Value>
+class LruCache {
+	using Entries = list<pair<Key, shared_ptr<Value>>>;
+
+	size_t capacity;
+	Entries entries;
+	std::map<Key, typename Entries::iterator> positions;
+	mutex cacheMutex;
+
+	void shrink() {
+		while (entries.size() > capacity) {
+			positions.erase(entries.back().first);
+			entries.pop_back();
+		}
+	}
+
+public:
+	explicit LruCache(const size_t& capacity = 0): capacity(capacity) {}
+
+	void setCapacity(const size_t& capacity) {
+		lock_guard<mutex> lock(cacheMutex);
+		this->capacity = capacity;
+		shrink();
+	}
+
+	bool isEnabled() {
+		lock_guard<mutex> lock(cacheMutex);
+		return capacity != 0;
+	}
+
+	shared_ptr<Value> get(const Key& key, const function<shared_ptr<Value>()>& load) {
+		unique_lock<mutex> lock(cacheMutex);
+		if (capacity == 0) {
+			lock.unlock();
+			return load();
+		}
+
+		if (const auto position = positions.find(key); position != positions.end()) {
+			entries.splice(entries.begin(), entries, position->second);
+			return position->second->second;
+		}
+
+		// Loaded under the lock, so that the threads asking for the same value do not load it more than once
+		entries.emplace_front(key, load());
+		positions[key] = entries.begin();
+		auto value = entries.front().second;
+		shrink();
+
+		return value;
+	}
+};
+
+#endif //LRUCACHE_H
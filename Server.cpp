@@ -0,0 +1,215 @@
+#include "Server.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <boost/property_tree/json_parser.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "FilesManipulator.h"
+
+using FM = FilesManipulator;
+
+//Time a client has to send its job in, and to take each part of the answer, as the jobs are served one at a time
+#define CLIENT_TIMEOUT_SECONDS 30
+
+AnalysisJob Server::parseJob(const string& request, const size_t& nThreads) {
+	boost::property_tree::ptree tree;
+	istringstream in(request);
+	read_json(in, tree);
+
+	AnalysisJob job;
+	job.alignment = tree.get<string>("alignment");
+	job.refGen = tree.get<string>("reference");
+	job.vcf = tree.get<string>("vcf");
+	job.region = tree.get<string>("region", "");
+	job.nThreads = tree.get<size_t>("threads", nThreads);
+	job.minReads = tree.get<size_t>("minReads", MIN_READS);
+	job.indelFlank = tree.get<size_t>("flank", job.indelFlank);
+	job.isTargeted = tree.get<bool>("targeted", false);
+	job.isMapped = tree.get<bool>("mmap", false);
+	job.maxDepth = tree.get<size_t>("maxDepth", 0);
+	job.seed = tree.get<uint64_t>("seed", 0);
+	job.groundTruth = tree.get<string>("truth", "");
+
+	return job;
+}
+
+bool Server::sendLine(const int& fd, const string& line) {
+	const string aux = line + "\n";
+	for (size_t sent = 0; sent != aux.size();) {
+		// A client that has gone away must not bring the server down with SIGPIPE
+		const ssize_t n = send(fd, aux.data() + sent, aux.size() - sent, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return false;
+		sent += n;
+	}
+
+	return true;
+}
+
+string Server::escape(const string& str) {
+	string escaped;
+	for (const char c : str) {
+		if (c == '"' || c == '\\') escaped += {'\\', c};
+		else if (static_cast<unsigned char>(c) < 0x20) {
+			char aux[7];
+			snprintf(aux, sizeof(aux), "\\u%04x", c);
+			escaped += aux;
+		} else escaped += c;
+	}
+
+	return escaped;
+}
+
+string Server::formRow(
+	const string& contig,
+	const string& type,
+	const size_t& pos,
+	const char& symbol,
+	const char& action,
+	const NucleoCounter& counter,
+	const string& extra
+) {
+	ostringstream str;
+	str << "{\"type\":\"" << type << "\",\"contig\":\"" << escape(contig) << "\",\"index\":" << pos << ",\"action\":\"" <<
+		escape(string(1, action)) << "\",\"symbol\":\"" << escape(string(1, symbol)) << "\",\"counts\":{";
+	for (size_t i = 0; i != NucleoCounter::alphabet::symbols.size(); i++) {
+		if (i != 0) str << ",";
+		str << "\"" << NucleoCounter::alphabet::symbols[i] << "\":" << counter.getCounters()[i];
+	}
+	str << "}" << extra << "}";
+
+	return str.str();
+}
+
+void Server::handleConnection(const int& fd, const size_t& nThreads) {
+	// The deadline is for the whole request, so that a client sending it byte by byte cannot hold the server either
+	const auto deadline = chrono::steady_clock::now() + chrono::seconds(CLIENT_TIMEOUT_SECONDS);
+	string request;
+	char buffer[4096];
+	while (request.find('\n') == string::npos) {
+		const auto left = chrono::duration_cast<chrono::microseconds>(deadline - chrono::steady_clock::now());
+		if (left.count() <= 0) return;
+		timeval timeout{};
+		timeout.tv_sec = left.count() / 1000000;
+		timeout.tv_usec = left.count() % 1000000;
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+		const ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+		if (n < 0 && errno == EINTR) continue;
+		// A timed out request is dropped, a client that has closed its side may still have sent a whole one
+		if (n < 0) return;
+		if (n == 0) break;
+		request.append(buffer, n);
+	}
+	if (const size_t end = request.find('\n'); end != string::npos) request.resize(end);
+	if (request.empty()) return;
+
+	timeval timeout{};
+	timeout.tv_sec = CLIENT_TIMEOUT_SECONDS;
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	const auto start = chrono::steady_clock::now();
+	AnalysisResult result;
+	try {
+		result = Analyser::run(parseJob(request, nThreads));
+	} catch (const exception& e) {
+		sendLine(fd, "{\"status\":\"error\",\"message\":\"" + escape(e.what()) + "\"}");
+		return;
+	}
+
+	// The rows are the ones of the csv report, followed by the summary of every contig
+	for (const auto& contig : result.contigResults) {
+		const CompRes& res = contig.res;
+		for (const auto& aux : res.diffInVCF) {
+			if (!sendLine(fd, formRow(contig.name, "Missed", get<0>(aux), get<1>(aux), get<2>(aux), get<3>(aux)))) return;
+		}
+		for (const auto& aux : res.diffInCust) {
+			if (!sendLine(fd, formRow(contig.name, "Additional", get<0>(aux), get<1>(aux), get<2>(aux), get<3>(aux)))) return;
+		}
+		for (const auto& aux : res.errors) {
+			const string expected = ",\"expectedAction\":\"" + escape(string(1, get<4>(aux))) +
+				"\",\"expectedSymbol\":\"" + escape(string(1, get<3>(aux))) + "\"";
+			if (!sendLine(fd, formRow(contig.name, "Error", get<0>(aux), get<1>(aux), get<2>(aux), get<5>(aux), expected)))
+				return;
+		}
+
+		for (const auto& [pos, depth] : contig.cappedDepths) {
+			if (!sendLine(fd, "{\"type\":\"Capped\",\"contig\":\"" + escape(contig.name) + "\",\"index\":" +
+				std::to_string(pos) + ",\"depth\":" + std::to_string(depth) + "}")) return;
+		}
+
+		for (const auto& [pos, symbol, action, mask] : contig.agreements) {
+			if (!sendLine(fd, "{\"type\":\"Agreement\",\"contig\":\"" + escape(contig.name) + "\",\"index\":" +
+				std::to_string(pos) + ",\"action\":\"" + escape(string(1, action)) + "\",\"symbol\":\"" +
+				escape(string(1, symbol)) + "\",\"class\":\"" + Sources::classes[mask] + "\"}")) return;
+		}
+
+		ostringstream summary;
+		summary << "{\"type\":\"Summary\",\"contig\":\"" << escape(contig.name) << "\",\"from\":" << contig.from <<
+			",\"to\":" << contig.to << ",\"reported\":" << contig.reportedErrorsVCF << ",\"missed\":" << res.diffInVCF.size()
+			<< ",\"additional\":" << res.diffInCust.size() << ",\"errors\":" << res.errors.size() << ",\"capped\":" << contig.cappedDepths.size() << "}";
+		if (!sendLine(fd, summary.str())) return;
+	}
+
+	const auto duration = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start);
+	sendLine(fd, "{\"status\":\"done\",\"milliseconds\":" + std::to_string(duration.count()) + "}");
+}
+
+void Server::serve(const string& socketPath, const size_t& cacheSize, const size_t& nThreads) {
+	sockaddr_un address{};
+	address.sun_family = AF_UNIX;
+	if (socketPath.size() >= sizeof(address.sun_path)) {
+		cerr << "The socket path " << socketPath << " is too long" << endl;
+		throw runtime_error("The socket path " + socketPath + " is too long");
+	}
+	strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+
+	// Only a socket left behind by an earlier server is removed, never a file the path was mistyped to
+	if (struct stat info{}; lstat(socketPath.c_str(), &info) == 0) {
+		if (!S_ISSOCK(info.st_mode)) {
+			cerr << socketPath << " exists and is not a socket" << endl;
+			throw runtime_error(socketPath + " exists and is not a socket");
+		}
+		unlink(socketPath.c_str());
+	}
+
+	// A job makes the server read any path it can open, so only its own user may connect. The permissions are
+	// restricted before listening, so that no connection is accepted in between
+	const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+		chmod(socketPath.c_str(), S_IRUSR | S_IWUSR) != 0 || listen(fd, 16) != 0) {
+		cerr << "Failed to listen on " << socketPath << ": " << strerror(errno) << endl;
+		if (fd >= 0) close(fd);
+		throw runtime_error("Failed to listen on " + socketPath);
+	}
+
+	FM::enableCaches(cacheSize);
+	cout << "Listening on " << socketPath << endl;
+
+	// The jobs are run one at a time, each of them spreading its contigs over nThreads
+	while (true) {
+		const int client = accept(fd, nullptr, nullptr);
+		if (client < 0) {
+			if (errno == EINTR) continue;
+			cerr << "Failed to accept a connection: " << strerror(errno) << endl;
+			break;
+		}
+
+		handleConnection(client, nThreads);
+		close(client);
+	}
+
+	close(fd);
+	unlink(socketPath.c_str());
+}
@@ -0,0 +1,24 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <string>
+
+#include "Analyser.h"
+
+using namespace std;
+
+//Long-running mode answering the analysis jobs sent over a Unix domain socket, one JSON object per line.
+//References, alignment indices and VCF truth sets stay cached between the jobs
+class Server {
+	static AnalysisJob parseJob(const string& request, const size_t& nThreads);
+	static bool sendLine(const int& fd, const string& line);
+	static string escape(const string& str);
+	static string formRow(const string& contig, const string& type, const size_t& pos, const char& symbol,
+	                      const char& action, const NucleoCounter& counter, const string& extra = "");
+	static void handleConnection(const int& fd, const size_t& nThreads);
+
+public:
+	static void serve(const string& socketPath, const size_t& cacheSize, const size_t& nThreads);
+};
+
+#endif //SERVER_H
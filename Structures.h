@@ -1,116 +1,143 @@
 #ifndef STRUCTURES_H
 #define STRUCTURES_H
+#include <algorithm>
+#include <array>
+#include <cstdint>
 #include <iostream>
+#include <iterator>
+#include <limits>
 #include <list>
 #include <map>
 #include <set>
 #include <string>
+#include <string_view>
 #include <tuple>
 #include <vector>
 
+#include "Tracer.h"
+
+#ifndef NUCLEO_COUNTER_MAX_DEPTH
+#define NUCLEO_COUNTER_MAX_DEPTH 65535
+#endif
+
 struct CompRes;
-struct NucleoCounter;
 struct Read;
 struct AlignmentMaps;
 struct Insertions;
 
 using namespace std;
-using MutationErrors = std::vector<std::tuple<size_t, char, char, NucleoCounter>>;
-using InBothEr = std::vector<std::tuple<size_t, char, char, char, char, NucleoCounter>>;
-using InsertionMap = std::map<size_t, std::pair<NucleoCounter, std::set<std::string>>>;
-using CigarString = list<pair<char, size_t>>;
-using Mutations = std::map<size_t, vector<std::tuple<char, char, NucleoCounter>>>;
-using MutationsVCF = std::map<size_t, vector<std::tuple<char, char>>>;
-using Alignments = map<size_t, set<pair<string, string>>>;
 
-inline std::map<char, size_t> nucleoMapping = {
-	{'-', 0},
-	{'A', 1},
-	{'C', 2},
-	{'G', 3},
-	{'T', 4},
+//Symbols the reads are counted by, sorted so that the index order is the alphabetical one
+struct Nucleotides {
+	static constexpr std::array<char, 5> symbols = {'-', 'A', 'C', 'G', 'T'};
+
+	//Symbols outside of the alphabet (N, ?) are counted together with the gaps
+	static constexpr std::array<uint8_t, 256> indices = [] {
+		std::array<uint8_t, 256> aux{};
+		for (size_t i = 0; i != symbols.size(); i++) aux[static_cast<unsigned char>(symbols[i])] = i;
+		return aux;
+	}();
 };
 
-inline std::map<size_t, char> rNucleoMapping = [] {
-	std::map<size_t, char> reverse;
-	for (const auto& [key, value] : nucleoMapping) {
-		reverse[value] = key;
-	}
-	return reverse;
-}();
+template <typename Alphabet, typename Counter>
+struct BasicNucleoCounter {
+	using alphabet = Alphabet;
+	using counter = Counter;
+	static constexpr size_t maxDepth = std::numeric_limits<Counter>::max();
 
-struct NucleoCounter {
 private:
-	std::vector<size_t> counters;
+	std::array<Counter, Alphabet::symbols.size()> counters{};
 
 public:
-	NucleoCounter(): counters(nucleoMapping.size()) {}
+	BasicNucleoCounter() = default;
 
+	//Saturates rather than wraps around, as the insertion counters are filled from every read of the window
 	void increase(const char& nucleo) {
-		counters[nucleoMapping[nucleo]]++;
+		Counter& counter = counters[Alphabet::indices[static_cast<unsigned char>(nucleo)]];
+		if (counter != std::numeric_limits<Counter>::max()) counter++;
 	}
 
 	void setCounter(const char& nucleo, const size_t& value) {
-		counters[nucleoMapping[nucleo]] = value;
+		counters[Alphabet::indices[static_cast<unsigned char>(nucleo)]] = value;
 	}
 
 	char findMax(const char& base) const {
-		size_t curMax = 0;
-		set<char> curMaxNucleos;
-
-		for (size_t i = 0; i != counters.size(); i++) {
-			if (counters[i] >= curMax) {
-				if (counters[i] > curMax) {
-					curMax = counters[i];
-					curMaxNucleos.clear();
-				}
-
-				curMaxNucleos.insert(rNucleoMapping[i]);
-			}
-		}
+		const Counter curMax = *max_element(counters.begin(), counters.end());
+		const size_t nMax = count(counters.begin(), counters.end(), curMax);
 
 		const double ratio = static_cast<double>(curMax) / size();
 		//TODO probably it is worth considering adding an epsilon here?
 		if (ratio >= 0.5) {
 			//Return the first alphabetically sorted non-base value if it is seen in at least 50% of cases
-			if (ratio > 0.5 || curMaxNucleos.size() == 1) return *curMaxNucleos.begin();
-			for (const auto& elem : curMaxNucleos) if (elem != base) return elem;
+			for (size_t i = 0; i != counters.size(); i++) {
+				if (counters[i] != curMax) continue;
+				if (ratio > 0.5 || nMax == 1 || Alphabet::symbols[i] != base) return Alphabet::symbols[i];
+			}
 		}
 
 		return base;
 	}
 
 	void flush() {
-		std::fill(counters.begin(), counters.end(), 0);
+		counters.fill(0);
 	}
 
-	void merge(const NucleoCounter& other) {
-		const auto result = other.getCounters();
+	void merge(const BasicNucleoCounter& other) {
 		for (size_t i = 0; i != counters.size(); i++) {
-			counters[i] += result[i];
+			counters[i] += other.counters[i];
 		}
 	}
 
-	vector<size_t> getCounters() const {
+	const std::array<Counter, Alphabet::symbols.size()>& getCounters() const {
 		return counters;
 	}
 
 	size_t size() const {
 		size_t counter = 0;
-		for (const size_t i : counters) counter += i;
+		for (const Counter i : counters) counter += i;
 
 		return counter;
 	}
 };
 
+//The counters are as narrow as the maximal supported depth allows. The bound is a 64-bit literal, as a comparison with
+//the maximum of uint16_t would be flagged by -Wtype-limits for every value of the macro above it
+using NucleoCounter = BasicNucleoCounter<Nucleotides, std::conditional_t<
+	NUCLEO_COUNTER_MAX_DEPTH < (uint64_t{1} << 16), uint16_t, uint32_t>>;
+
+using MutationErrors = std::vector<std::tuple<size_t, char, char, NucleoCounter>>;
+using InBothEr = std::vector<std::tuple<size_t, char, char, char, char, NucleoCounter>>;
+using InsertionMap = std::map<size_t, std::pair<NucleoCounter, std::set<std::string>>>;
+using CigarString = list<pair<char, size_t>>;
+using Mutations = std::map<size_t, vector<std::tuple<char, char, NucleoCounter>>>;
+using MutationsVCF = std::map<size_t, vector<std::tuple<char, char>>>;
+using Alignments = map<size_t, set<pair<string, string>>>;
+using CigarIndices = std::map<std::string, std::tuple<size_t, size_t, size_t>>;
+//Index, symbol, action and the agreement class (a mask of Sources) of every mutation found by any of the sources
+using Agreements = std::vector<std::tuple<size_t, char, char, uint8_t>>;
+
+//Sources a mutation can be found in when the calls are compared with both the VCF and a truth set
+struct Sources {
+	static constexpr uint8_t calls = 1;
+	static constexpr uint8_t vcf = 2;
+	static constexpr uint8_t truth = 4;
+
+	static constexpr std::array<const char*, 8> classes = {
+		"None", "Only ours", "Only FreeBayes", "Ours and FreeBayes", "Only truth", "Ours and truth",
+		"FreeBayes and truth", "All"
+	};
+};
+
 struct Insertions {
 private:
 	InsertionMap insertions;
 	InsertionMap nextWindowInsertions;
 	set<size_t> insertionIndices;
 
-	InsertionMap* curMap;
-	string expandedRead;
+	//A flag rather than a pointer to the current map, so that the object can be moved
+	bool isNextWindow = false;
+	//Points into the read owned by the caller for as long as the read is being added
+	string_view expandedRead;
 	string name;
 
 	std::map<size_t, NucleoCounter> nonErrors;
@@ -122,13 +149,17 @@ private:
 		const size_t& end,
 		const bool isInsertion
 	) {
+		InsertionMap& curMap = isNextWindow ? nextWindowInsertions : insertions;
 		for (size_t i = start; i != end; i++) {
+			//A position is counted from at most as many reads as the counters hold, like the ones of Reads, so that
+			//a saturated gap counter never skews the ratio of the others
+			if (curMap[refGenIndex + i].first.size() >= NucleoCounter::maxDepth) continue;
 			if (isInsertion) {
-				(*curMap)[refGenIndex + i].first.increase(expandedRead[curReadIndex + i]);
-				(*curMap)[refGenIndex + i].second.insert(name);
+				curMap[refGenIndex + i].first.increase(expandedRead[curReadIndex + i]);
+				curMap[refGenIndex + i].second.insert(name);
 				insertionIndices.insert(refGenIndex + i);
-			} else if ((*curMap)[refGenIndex + i].second.find(name) == (*curMap)[refGenIndex + i].second.end()) {
-				(*curMap)[refGenIndex + i].first.increase('-');
+			} else if (curMap[refGenIndex + i].second.find(name) == curMap[refGenIndex + i].second.end()) {
+				curMap[refGenIndex + i].first.increase('-');
 			}
 		}
 	}
@@ -136,23 +167,29 @@ private:
 public:
 	Insertions() = default;
 
-	Insertions(
-		const InsertionMap& insertions,
-		const InsertionMap& nextWindowInsertions = InsertionMap(),
-		const set<size_t>& insertionIndices = set<size_t>()
-	): insertions(insertions), nextWindowInsertions(nextWindowInsertions), insertionIndices(insertionIndices) {
-		curMap = &this->insertions;
-	}
+	explicit Insertions(
+		InsertionMap insertions,
+		InsertionMap nextWindowInsertions = InsertionMap(),
+		set<size_t> insertionIndices = set<size_t>()
+	): insertions(std::move(insertions)), nextWindowInsertions(std::move(nextWindowInsertions)),
+	   insertionIndices(std::move(insertionIndices)) {}
 
 	void setRead(const string& expandedRead, const string& name) {
-		this->expandedRead = move(expandedRead);
-		this->name = move(name);
+		this->expandedRead = expandedRead;
+		this->name = name;
 	}
 
-	InsertionMap getNextWindowInsertions() const {
+	const InsertionMap& getNextWindowInsertions() const {
 		return nextWindowInsertions;
 	}
 
+	//Hands the insertions reaching over the window boundary over to the next window, leaving none behind
+	InsertionMap takeNextWindowInsertions() {
+		InsertionMap aux;
+		aux.swap(nextWindowInsertions);
+		return aux;
+	}
+
 	void addInsertion(
 		const size_t& refGenIndex,
 		const size_t& curReadIndex,
@@ -162,13 +199,30 @@ public:
 	) {
 		if (left != end) {
 			this->addValues(refGenIndex, curReadIndex, 0, left, isInsertion);
-			curMap = &this->nextWindowInsertions;
+			isNextWindow = true;
 			this->addValues(refGenIndex, curReadIndex, left, end, isInsertion);
-			curMap = &this->insertions;
+			isNextWindow = false;
 		} else this->addValues(refGenIndex, curReadIndex, 0, end, isInsertion);
 	}
 
+	//Counts the inserted bases of a read clipped at the start of the window the way an earlier window hands them over,
+	//without marking their positions as insertions of this window
+	void addCarriedInsertion(
+		const size_t& refGenIndex,
+		const size_t& curReadIndex,
+		const size_t& start,
+		const size_t& end
+	) {
+		for (size_t i = start; i != end; i++) {
+			auto& insertion = insertions[refGenIndex + i];
+			if (insertion.first.size() >= NucleoCounter::maxDepth) continue;
+			insertion.first.increase(expandedRead[curReadIndex + i]);
+			insertion.second.insert(name);
+		}
+	}
+
 	Mutations findInsertionMutations(const MutationsVCF& mutationsVCF, const size_t& minReads) {
+		TRACE_SPAN("findInsertionMutations");
 		Mutations errors;
 
 		for (const size_t& index : insertionIndices) {
@@ -177,6 +231,9 @@ public:
 					errors[index].emplace_back(maxNucleo, 'I', insertions[index].first);
 		}
 
+		//Small regions (e.g. the targeted ones) may have no insertions at all
+		if (insertionIndices.empty()) return errors;
+
 		const size_t min = *insertionIndices.begin();
 		const size_t max = *insertionIndices.rbegin();
 
@@ -197,9 +254,10 @@ public:
 		return errors;
 	}
 
-	std::map<size_t, NucleoCounter> getNonErrors() {
-		const auto aux = insertions[312543];
-		return nonErrors;
+	std::map<size_t, NucleoCounter> takeNonErrors() {
+		std::map<size_t, NucleoCounter> aux;
+		aux.swap(nonErrors);
+		return aux;
 	}
 
 	void flushNonErrors() {
@@ -212,10 +270,10 @@ struct AlignmentMaps {
 	Insertions windowInsertions;
 
 	AlignmentMaps(
-		const Alignments& alignments,
-		const Insertions& windowInsertions
-	): startingPos(alignments),
-	   windowInsertions(windowInsertions) {}
+		Alignments alignments,
+		Insertions windowInsertions
+	): startingPos(std::move(alignments)),
+	   windowInsertions(std::move(windowInsertions)) {}
 
 	AlignmentMaps() = default;
 };
@@ -235,67 +293,175 @@ struct CompRes {
 		InBothEr errors
 	): diffInVCF(std::move(diffInVCF)), diffInCust(std::move(diffInCust)), errors(std::move(errors)) {}
 
-	void merge(CompRes& res) {
-		diffInVCF.insert(diffInVCF.end(), res.diffInVCF.begin(), res.diffInVCF.end());
-		diffInCust.insert(diffInCust.end(), res.diffInCust.begin(), res.diffInCust.end());
-		this->errors.insert(this->errors.end(), res.errors.begin(), res.errors.end());
+	void merge(CompRes&& res) {
+		diffInVCF.insert(diffInVCF.end(), make_move_iterator(res.diffInVCF.begin()),
+		                 make_move_iterator(res.diffInVCF.end()));
+		diffInCust.insert(diffInCust.end(), make_move_iterator(res.diffInCust.begin()),
+		                  make_move_iterator(res.diffInCust.end()));
+		this->errors.insert(this->errors.end(), make_move_iterator(res.errors.begin()),
+		                    make_move_iterator(res.errors.end()));
 	}
 };
 
+//Mutations reported in a VCF along with the number of reported records, both per contig
+struct TruthSet {
+	std::map<string, MutationsVCF> mutations;
+	std::map<string, size_t> reportedErrors;
+};
+
+//Everything processContig carries over from a window to the next one, along with the results of the windows since the
+//previous save, so that a run can be continued from the window
+struct Checkpoint {
+	//Start of the next window
+	size_t windowStartInd = 0;
+	//Whether the out of boundary insertions following the last window have been compared as well
+	bool isFinished = false;
+	CigarIndices cigarIndices;
+	InsertionMap nextWindowInsertions;
+	//Active reads as (starting position, sequence, rank), along with the number of the dropped ones ending at a position
+	vector<std::tuple<size_t, string, uint64_t>> reads;
+	std::map<size_t, size_t> droppedEnds;
+	std::map<size_t, NucleoCounter> nonErrors;
+	//Size of the appended results the state belongs to, anything after it is left by a run killed while saving
+	uint64_t resultsSize = 0;
+
+	CompRes res;
+	Mutations calls;
+	std::map<size_t, size_t> cappedDepths;
+	Agreements agreements;
+};
+
 struct Read {
-	size_t index;
+	const size_t startPos;
 	const size_t endPos;
+	//The reads with the lowest ranks are the ones analysed at a position once the depth is capped
+	const uint64_t rank;
 	const string sequence;
 
-	explicit Read(const string& read, const size_t& startingPos): index(0),
-	                                                              endPos(startingPos + read.size() - 1),
-	                                                              sequence(read) {}
+	explicit Read(string read, const size_t& startingPos, const uint64_t& rank): startPos(startingPos),
+		endPos(startingPos + read.size() - 1), rank(rank), sequence(std::move(read)) {}
+
+	bool operator<(const Read& other) const {
+		return tie(rank, startPos) < tie(other.rank, other.startPos);
+	}
 };
 
 struct Reads {
 private:
-	list<Read> reads;
-	list<string> names;
+	//Active reads ordered by their rank, along with the positions they end at
+	multiset<Read> reads;
+	multimap<size_t, multiset<Read>::const_iterator> readEnds;
 	string curRefGenLine;
 	std::map<size_t, NucleoCounter> nonErrors;
+	//At most maxDepth reads are analysed at a position, never more than the counters can hold
+	size_t maxDepth = NucleoCounter::maxDepth;
+	uint64_t seed = 0;
+	//Original depth of the positions at which not all of the reads have been analysed
+	std::map<size_t, size_t> cappedDepths;
+	//Reads which can no longer be analysed are only kept as the number of them ending at a position, for the depth
+	std::map<size_t, size_t> droppedEnds;
+	size_t nDropped = 0;
+	//Number of the active reads at which the outranked ones are dropped next
+	size_t dropAt = 0;
+
+	//FNV-1a of the name mixed with the seed by splitmix64, so that the rank of a read depends on nothing else
+	uint64_t getRank(const string& name) const {
+		uint64_t hash = 14695981039346656037ull;
+		for (const char c : name) hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+		hash += seed + 0x9e3779b97f4a7c15ull;
+		hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ull;
+		hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebull;
+		return hash ^ (hash >> 31);
+	}
+
+	void addRead(string read, const size_t& curPos, const uint64_t& rank) {
+		//TODO empty sequences appear again for some reason
+		if (read.empty()) return;
+
+		const auto iter = reads.emplace(std::move(read), curPos, rank);
+		readEnds.emplace(iter->endPos, iter);
+	}
+
+	//Drops the reads outlasted by at least maxDepth reads of lower ranks: the latter cover every position left of the
+	//former, and the reads added later only compete for the sample as well, so the former are never analysed again.
+	//The reads are visited by their rank, counting the ends of the kept ones in a Fenwick tree over the sorted ends
+	void dropOutranked() {
+		vector<size_t> ends;
+		ends.reserve(reads.size());
+		for (const auto& read : reads) ends.push_back(read.endPos);
+		sort(ends.begin(), ends.end());
+
+		//Indexed by the number of ends at or after an end, so that a prefix sum counts the reads outlasting it
+		vector<size_t> tree(ends.size() + 1);
+		for (auto iter = reads.begin(); iter != reads.end();) {
+			const size_t index = ends.end() - lower_bound(ends.begin(), ends.end(), iter->endPos);
+			size_t nOutlasting = 0;
+			for (size_t i = index; i != 0; i -= i & -i) nOutlasting += tree[i];
+
+			if (nOutlasting < maxDepth) {
+				for (size_t i = index; i < tree.size(); i += i & -i) tree[i]++;
+				++iter;
+				continue;
+			}
+
+			auto entry = readEnds.lower_bound(iter->endPos);
+			while (entry->second != iter) ++entry;
+			readEnds.erase(entry);
+			droppedEnds[iter->endPos]++;
+			nDropped++;
+			iter = reads.erase(iter);
+		}
+	}
 
 public:
-	Reads() = default;
+	//A maxDepth of 0 means no other limit than the one of the counters
+	explicit Reads(const size_t& maxDepth = 0, const uint64_t& seed = 0): seed(seed) {
+		if (maxDepth != 0) this->maxDepth = min<size_t>(maxDepth, NucleoCounter::maxDepth);
+		dropAt = 2 * this->maxDepth;
+	}
 
-	void setRefGenLine(const string& refGenLine) {
-		this->curRefGenLine = refGenLine;
+	void setRefGenLine(string refGenLine) {
+		this->curRefGenLine = std::move(refGenLine);
 	}
 
-	void addReads(const Alignments& startingPos, const size_t& curPos) {
-		for (const auto& [first, second] : startingPos.at(curPos)) {
-			reads.emplace_front(first, curPos);
-			names.emplace_front(second);
+	//The reads are moved out of startingPos, which no longer has the position afterwards
+	void addReads(Alignments& startingPos, const size_t& curPos) {
+		auto readsNode = startingPos.extract(curPos);
+		while (!readsNode.mapped().empty()) {
+			auto readNode = readsNode.mapped().extract(readsNode.mapped().begin());
+			addRead(std::move(readNode.value().first), curPos, getRank(readNode.value().second));
+		}
+
+		//Dropping is only worth its cost once the active reads have doubled since the last time
+		if (reads.size() >= dropAt) {
+			dropOutranked();
+			dropAt = 2 * max(reads.size(), maxDepth);
 		}
 	}
 
+	//Only the maxDepth reads with the lowest ranks among the ones covering the position are analysed (a bottom-k sample),
+	//so the sample at a position depends only on its reads and the seed, not on where the processing has started
 	Mutations iteration(const size_t& curPos, const size_t& linePos, const size_t& minReads, const bool isReported) {
-		char curNucleo;
 		NucleoCounter nucleoCounter;
 		Mutations errors;
 
-		const bool isRelevant = reads.size() >= minReads;
-		for (auto iter = reads.begin(); iter != reads.end();) {
-			if (isRelevant) {
-				//TODO empty sequences appear again for some reason
-				curNucleo = (iter->sequence)[iter->index];
-				nucleoCounter.increase(curNucleo);
-			}
+		const size_t nAnalysed = min(reads.size(), maxDepth);
+		if (nAnalysed != reads.size() + nDropped) cappedDepths[curPos] = reads.size() + nDropped;
 
-			// If this is the end of the sequence, remove it from the list of analysed ones
-			if (iter->endPos == curPos) {
-				auto namesIter = names.begin();
-				advance(namesIter, distance(reads.begin(), iter));
-				names.erase(namesIter);
-				iter = reads.erase(iter);
-			} else {
-				iter->index++;
-				++iter;
-			}
+		const bool isRelevant = nAnalysed >= minReads;
+		if (isRelevant) {
+			auto iter = reads.begin();
+			for (size_t i = 0; i != nAnalysed; i++, ++iter) nucleoCounter.increase(iter->sequence[curPos - iter->startPos]);
+		}
+
+		// If this is the end of the sequence, remove it from the list of analysed ones
+		while (!readEnds.empty() && readEnds.begin()->first <= curPos) {
+			reads.erase(readEnds.begin()->second);
+			readEnds.erase(readEnds.begin());
+		}
+		while (!droppedEnds.empty() && droppedEnds.begin()->first <= curPos) {
+			nDropped -= droppedEnds.begin()->second;
+			droppedEnds.erase(droppedEnds.begin());
 		}
 
 		if (isRelevant) {
@@ -311,13 +477,40 @@ public:
 		return errors;
 	}
 
-	std::map<size_t, NucleoCounter> getNonErrors() {
-		return nonErrors;
+	std::map<size_t, NucleoCounter> takeNonErrors() {
+		std::map<size_t, NucleoCounter> aux;
+		aux.swap(nonErrors);
+		return aux;
 	}
 
 	void flushNonErrors() {
 		nonErrors.clear();
 	}
+
+	std::map<size_t, size_t> takeCappedDepths() {
+		std::map<size_t, size_t> aux;
+		aux.swap(cappedDepths);
+		return aux;
+	}
+
+	void saveState(Checkpoint& checkpoint) const {
+		checkpoint.reads.clear();
+		for (const auto& read : reads) checkpoint.reads.emplace_back(read.startPos, read.sequence, read.rank);
+		checkpoint.droppedEnds = droppedEnds;
+	}
+
+	void restoreState(Checkpoint& checkpoint) {
+		reads.clear();
+		readEnds.clear();
+		for (auto& [startPos, sequence, rank] : checkpoint.reads) addRead(std::move(sequence), startPos, rank);
+		checkpoint.reads.clear();
+
+		droppedEnds = std::move(checkpoint.droppedEnds);
+		checkpoint.droppedEnds.clear();
+		nDropped = 0;
+		for (const auto& [end, n] : droppedEnds) nDropped += n;
+		dropAt = 2 * max(reads.size(), maxDepth);
+	}
 };
 
 #endif //STRUCTURES_H
@@ -0,0 +1,90 @@
+#include "Tracer.h"
+
+#ifdef TRACE_WINDOWS
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Number of the latest spans kept per thread, the older ones are overwritten
+#define TRACE_BUFFER_SIZE (1 << 16)
+
+namespace {
+	struct ThreadBuffer {
+		size_t tid;
+		vector<Tracer::Event> events;
+		size_t recorded = 0;
+
+		explicit ThreadBuffer(const size_t& tid): tid(tid), events(TRACE_BUFFER_SIZE) {}
+	};
+
+	// The buffers are owned here rather than by the threads, so that the spans of the finished workers can still be saved
+	mutex buffersMutex;
+	vector<unique_ptr<ThreadBuffer>> buffers;
+	thread_local ThreadBuffer* localBuffer = nullptr;
+
+	void writeEscaped(ofstream& out, const char* str) {
+		for (; *str; str++) {
+			if (*str == '"' || *str == '\\') out << '\\';
+			out << *str;
+		}
+	}
+}
+
+bool Tracer::enabled = false;
+chrono::steady_clock::time_point Tracer::origin;
+
+void Tracer::enable() {
+	origin = chrono::steady_clock::now();
+	enabled = true;
+}
+
+bool Tracer::isEnabled() {
+	return enabled;
+}
+
+int64_t Tracer::now() {
+	return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - origin).count();
+}
+
+void Tracer::record(const Event& event) {
+	// Only the first span of a thread takes the lock, the rest is written into its own ring buffer
+	if (!localBuffer) {
+		lock_guard<mutex> lock(buffersMutex);
+		buffers.emplace_back(make_unique<ThreadBuffer>(buffers.size()));
+		localBuffer = buffers.back().get();
+	}
+
+	localBuffer->events[localBuffer->recorded++ % TRACE_BUFFER_SIZE] = event;
+}
+
+void Tracer::save(const string& fileName) {
+	lock_guard<mutex> lock(buffersMutex);
+
+	ofstream out(fileName);
+	out << "{\"traceEvents\":[";
+	bool isFirst = true;
+	for (const auto& buffer : buffers) {
+		if (!isFirst) out << ",";
+		isFirst = false;
+		out << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->tid <<
+			",\"args\":{\"name\":\"thread " << buffer->tid << "\"}}";
+
+		const size_t from = buffer->recorded > TRACE_BUFFER_SIZE ? buffer->recorded - TRACE_BUFFER_SIZE : 0;
+		for (size_t i = from; i != buffer->recorded; i++) {
+			const Event& event = buffer->events[i % TRACE_BUFFER_SIZE];
+			out << ",\n{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->tid <<
+				",\"ts\":" << event.start << ",\"dur\":" << event.duration;
+			if (event.detail) {
+				out << ",\"args\":{\"contig\":\"";
+				writeEscaped(out, event.detail);
+				out << "\",\"window\":" << event.value << "}";
+			}
+			out << "}";
+		}
+	}
+	out << "\n]}" << endl;
+	out.close();
+}
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef TRACER_H
+#define TRACER_H
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+using namespace std;
+
+// Spans are only recorded when the tool is built with TRACE_WINDOWS; otherwise the macros expand to nothing
+#ifdef TRACE_WINDOWS
+#define TRACE_CONCAT_IMPL(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_IMPL(a, b)
+#define TRACE_SPAN(...) TraceSpan TRACE_CONCAT(traceSpan, __LINE__)(__VA_ARGS__)
+#else
+#define TRACE_SPAN(...)
+#endif
+
+class Tracer {
+public:
+	struct Event {
+		const char* name;
+		// Has to outlive the tracer, e.g. a contig name owned by main
+		const char* detail;
+		size_t value;
+		int64_t start;
+		int64_t duration;
+	};
+
+	static void enable();
+	static bool isEnabled();
+	static int64_t now();
+	static void record(const Event& event);
+	static void save(const string& fileName);
+
+private:
+	static bool enabled;
+	static chrono::steady_clock::time_point origin;
+};
+
+struct TraceSpan {
+private:
+	Tracer::Event event;
+
+public:
+	explicit TraceSpan(const char* name, const char* detail = nullptr, const size_t& value = 0):
+		event{name, detail, value, Tracer::isEnabled() ? Tracer::now() : 0, 0} {}
+
+	~TraceSpan() {
+		if (!Tracer::isEnabled()) return;
+		event.duration = Tracer::now() - event.start;
+		Tracer::record(event);
+	}
+
+	TraceSpan(const TraceSpan&) = delete;
+	TraceSpan& operator=(const TraceSpan&) = delete;
+};
+
+#endif //TRACER_H
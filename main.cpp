@@ -1,117 +1,132 @@
+#include <algorithm>
+#include <cctype>
 #include <filesystem>
 #include <iostream>
-#include <fstream>
+#include <stdexcept>
+#include <thread>
 #include <utility>
 
+#include "Analyser.h"
 #include "FilesManipulator.h"
-#include "Comparator.h"
+#include "Server.h"
+#include "Tracer.h"
 
 using FM = FilesManipulator;
 
-#define LINES_IN_WINDOW int(1e2)
-#define MIN_READS 5
-
 using namespace std;
 
-int main(int argc, char* argv[]) {
-	auto start = std::chrono::high_resolution_clock::now();
+//Value of the option at argv[i], which is moved past it
+static string optionValue(int& i, const int& argc, char* argv[]) {
+	if (i + 1 == argc) throw invalid_argument(string(argv[i]) + " needs a value");
+	return argv[++i];
+}
 
-	const string fpAlignment = FM::formFullPath(argv[1]);
-	const string fpRefGen = FM::formFullPath(argv[2]);
-	const string referenceCsv = FM::formFullPath(argv[3]);
+static size_t optionNumber(int& i, const int& argc, char* argv[]) {
+	const string option = argv[i];
+	const string value = optionValue(i, argc, argv);
+	size_t end = 0;
+	size_t number = 0;
+	try {
+		if (!value.empty() && isdigit(static_cast<unsigned char>(value[0]))) number = stoull(value, &end);
+	} catch (const exception&) {
+		end = 0;
+	}
+	if (end == 0 || end != value.size()) throw invalid_argument("Invalid value of " + option + ": " + value);
 
-	const size_t refGenLen = FM::getRefGenLength(fpAlignment);
-	const string refGenName = FM::getRefGenName(fpAlignment);
+	return number;
+}
 
-	ifstream refGenFile(fpRefGen);
-	if (!refGenFile.is_open()) {
-		cerr << "Failed to open file: " << fpRefGen << "\n";
-		return -1;
+int main(int argc, char* argv[]) {
+	auto start = std::chrono::high_resolution_clock::now();
+
+	if (argc > 1 && string(argv[1]) == "merge") {
+		vector<string> shards;
+		for (int i = 2; i < argc; i++) shards.emplace_back(FM::formFullPath(argv[i]));
+		try {
+			FM::mergeShards(shards);
+		} catch (const runtime_error&) {
+			return -1;
+		}
+		return 0;
 	}
 
-	string curRefGenLine;
-	size_t curStart = 0;
-	Reads curReads;
-	size_t linePos;
-	NucleoCounter nucleoCounter;
-	CompRes res;
-
-	while (getline(refGenFile, curRefGenLine) && (curRefGenLine.empty() || curRefGenLine[0] == '>'));
-	const size_t WINDOW_SIZE = curRefGenLine.size() * LINES_IN_WINDOW;
-
-	refGenFile.seekg(0, std::ios::beg);
-
-	auto alignments = AlignmentMaps();
-	auto startingPos = alignments.startingPos;
-	auto insertions = alignments.windowInsertions;
-	size_t reportedErrorsVCF = 0;
-	MutationsVCF csvMap = FM::readFreeBayesVCF(referenceCsv, reportedErrorsVCF);
-	size_t windowStartInd;
-
-	// Iterating through all the available sliding windows in order to cover the whole ref genome without memory exhaustion
-	for (windowStartInd = 0; windowStartInd < refGenLen; windowStartInd += WINDOW_SIZE) {
-		// Get reads within the sliding window
-		alignments = FM::getAlignments(fpAlignment, windowStartInd, windowStartInd + WINDOW_SIZE, refGenName, insertions.getNextWindowInsertions());
-		startingPos = alignments.startingPos;
-		insertions = alignments.windowInsertions;
-		Mutations errors;
-		curReads.flushNonErrors();
-		insertions.flushNonErrors();
-
-		size_t linesCovered = 0;
-		while (linesCovered < LINES_IN_WINDOW && getline(refGenFile, curRefGenLine)) {
-			if (curRefGenLine.empty() || curRefGenLine[0] == '>') continue;
-
-			curReads.setRefGenLine(curRefGenLine);
-			for (linePos = 0; linePos < curRefGenLine.size(); linePos++) {
-				size_t curPos = linePos + curStart;
-
-				// Add new reads that start at the current position to the list of the ones analysed
-				if (startingPos.find(curPos) != startingPos.end()) curReads.addReads(startingPos, curPos);
-
-				//TODO if the size of curReads is less than 5, move curPos to the next element available in startingPos or among insertion indices
-				//TODO instead of constantly iterating over reads, have a map that will store pointers to the respective curReads and name of the read
-
-				// If the number of reads for the current position is less than 5, we do not have enough data to do a meaningful evaluation
-				bool isMutation = false;
-				if (csvMap.find(curPos) != csvMap.end()) {
-					for (const auto& aux: csvMap.at(curPos)) {
-						if (std::get<1>(aux) != 'I') {
-							isMutation = true;
-							break;
-						}
-					}
-				}
-
-				auto curErrors = curReads.iteration(curPos, linePos, MIN_READS, isMutation);
-				if (!curErrors.empty()) errors.merge(curErrors);
-
-				nucleoCounter.flush();
+	size_t nThreads = max(1u, thread::hardware_concurrency());
+	if (argc > 2 && string(argv[1]) == "serve") {
+		size_t cacheSize = 8;
+		try {
+			for (int i = 3; i < argc; i++) {
+				const string option = argv[i];
+				if (option == "--cache") cacheSize = optionNumber(i, argc, argv);
+				else if (option == "--threads") nThreads = max(1ul, optionNumber(i, argc, argv));
+				else throw invalid_argument("Unknown option: " + option);
 			}
-			curStart += linePos;
-			linesCovered++;
+		} catch (const invalid_argument& e) {
+			cerr << e.what() << "\n";
+			return -1;
 		}
 
-		const auto insErrors = insertions.findInsertionMutations(csvMap, MIN_READS);
-		for (const auto& [key, vec] : insErrors) {
-			errors[key].insert(errors[key].end(), vec.begin(), vec.end());
+		try {
+			Server::serve(argv[2], cacheSize, nThreads);
+		} catch (const runtime_error&) {
+			return -1;
+		}
+		return 0;
+	}
+
+	if (argc < 4) {
+		cerr << "Usage: " << argv[0] << " <alignment> <reference> <vcf> [options]\n";
+		return -1;
+	}
+
+	AnalysisJob job;
+	job.alignment = FM::formFullPath(argv[1]);
+	job.refGen = FM::formFullPath(argv[2]);
+	job.vcf = FM::formFullPath(argv[3]);
+	job.nThreads = nThreads;
+	string traceFile;
+	string bcfFile;
+	try {
+		for (int i = 4; i < argc; i++) {
+			const string option = argv[i];
+			if (option == "--targeted") job.isTargeted = true;
+			else if (option == "--mmap") job.isMapped = true;
+			else if (option == "--resume") job.isResumed = true;
+			else if (option == "--region") job.region = optionValue(i, argc, argv);
+			else if (option == "--threads") job.nThreads = max(1ul, optionNumber(i, argc, argv));
+			else if (option == "--trace") traceFile = FM::formFullPath(optionValue(i, argc, argv));
+			else if (option == "--bcf") bcfFile = FM::formFullPath(optionValue(i, argc, argv));
+			else if (option == "--flank") job.indelFlank = optionNumber(i, argc, argv);
+			else if (option == "--max-depth") job.maxDepth = optionNumber(i, argc, argv);
+			else if (option == "--seed") job.seed = optionNumber(i, argc, argv);
+			else if (option == "--truth") job.groundTruth = FM::formFullPath(optionValue(i, argc, argv));
+			else if (option == "--checkpoint") job.checkpoint = FM::formFullPath(optionValue(i, argc, argv));
+			else if (option == "--checkpoint-every") job.checkpointEvery = max(1ul, optionNumber(i, argc, argv));
+			else throw invalid_argument("Unknown option: " + option);
 		}
-		auto nonErrors = insertions.getNonErrors();
-		auto nonErrors2 = curReads.getNonErrors();
-		nonErrors.insert(nonErrors2.begin(), nonErrors2.end());
-		auto aux = Comparator::compareMaps(csvMap, errors, nonErrors, windowStartInd, windowStartInd + WINDOW_SIZE);
-		res.merge(aux);
+	} catch (const invalid_argument& e) {
+		cerr << e.what() << "\n";
+		return -1;
 	}
 
-	//We may have out of boundary indices that are not within the defined windows
-	Mutations errors;
-	if (auto nextWindIns = insertions.getNextWindowInsertions(); !nextWindIns.empty()) {
-		errors.merge(Insertions(nextWindIns).findInsertionMutations(csvMap, MIN_READS));
-		auto nonErrors = insertions.getNonErrors();
-		auto nonErrors2 = curReads.getNonErrors();
-		nonErrors.insert(nonErrors2.begin(), nonErrors2.end());
-		auto aux = Comparator::compareMaps(csvMap, errors, nonErrors, windowStartInd, windowStartInd + WINDOW_SIZE);
-		res.merge(aux);
+	job.isCollectingCalls = !bcfFile.empty();
+
+	if (job.isResumed && job.checkpoint.empty()) {
+		cerr << "--resume needs the --checkpoint the interrupted run was started with\n";
+		return -1;
+	}
+	if (job.isTargeted && !job.checkpoint.empty()) cerr << "--checkpoint is ignored in the targeted mode\n";
+
+#ifdef TRACE_WINDOWS
+	if (!traceFile.empty()) Tracer::enable();
+#else
+	if (!traceFile.empty()) cerr << "--trace is ignored since the tool was built without TRACE_WINDOWS\n";
+#endif
+
+	AnalysisResult result;
+	try {
+		result = Analyser::run(job);
+	} catch (const runtime_error&) {
+		return -1;
 	}
 
 	auto end = std::chrono::high_resolution_clock::now();
@@ -123,5 +138,32 @@ int main(int argc, char* argv[]) {
 
 	std::cout << "Execution time: " << minutes << " minutes and " << seconds << " seconds" << std::endl;
 
-	FilesManipulator::saveToCsv(FM::getRefGenName(fpAlignment) + "new", res, reportedErrorsVCF);
+	for (auto& contig : result.contigResults) {
+		const string geneName = contig.name + "new";
+		string reportName = geneName;
+		if (job.region.empty()) FilesManipulator::saveToCsv(geneName, contig.res, contig.reportedErrorsVCF);
+		else {
+			const string shardName = geneName + "." + std::to_string(contig.from) + "-" + std::to_string(contig.to);
+			FM::saveShard(FM::formFullPath(shardName + ".shard"), geneName, contig.from, contig.to, contig.length,
+			              result.windowSize, contig.res, contig.reportedErrorsVCF);
+			reportName = shardName;
+		}
+		if (!contig.cappedDepths.empty()) {
+			const size_t maxDepth = job.maxDepth != 0 ? job.maxDepth : NucleoCounter::maxDepth;
+			FM::saveCappedDepths(FM::formFullPath(reportName + ".capped.csv"), contig.cappedDepths, maxDepth);
+		}
+		if (!job.groundTruth.empty() && !contig.agreements.empty()) {
+			FM::saveAgreements(FM::formFullPath(reportName + ".truth.csv"), contig.agreements);
+		}
+	}
+	if (!bcfFile.empty()) {
+		std::map<string, Mutations> contigCalls;
+		for (auto& contig : result.contigResults) contigCalls[contig.name] = std::move(contig.calls);
+		FM::saveToBcf(bcfFile, job.refGen, filesystem::path(job.alignment).stem().string(), result.contigs,
+		              contigCalls);
+	}
+
+#ifdef TRACE_WINDOWS
+	if (!traceFile.empty()) Tracer::save(traceFile);
+#endif
 }